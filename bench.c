@@ -0,0 +1,601 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "ppm_io.h"
+#include "image_manip.h"
+#include "kernel_cache.h"
+
+
+/* Benchmark driver for the image operations.
+ * USAGE: ./bench [<input-image>] [<repetitions>]
+ * Output images are written to /dev/null so only the operation is timed.
+ */
+
+
+// Returns the current time in seconds
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// Blur sigmas that give 3, 5, 7, 11 and 15 tap windows
+static const float blur_sigmas[] = { 0.3f, 0.5f, 0.7f, 1.1f, 1.5f, 2.0f };
+#define NUM_SIGMAS (sizeof(blur_sigmas) / sizeof(blur_sigmas[0]))
+
+// Median radii; the first two have selection network specializations
+static const int median_radii[] = { 1, 2, 5, 15 };
+#define NUM_RADII (sizeof(median_radii) / sizeof(median_radii[0]))
+
+// Zoom factors, the last of which has no specialization
+static const int zoom_factors[] = { 2, 3, 4, 5 };
+#define NUM_FACTORS (sizeof(zoom_factors) / sizeof(zoom_factors[0]))
+
+
+// Times reps calls of blur (after one warm-up call), returning average seconds per call
+static double time_blur(Image *img, FILE *sink, float sigma, int reps) {
+    blur(img, sink, sigma);
+    double start = now();
+    for (int r = 0; r < reps; r++) {
+        blur(img, sink, sigma);
+    }
+    return (now() - start) / reps;
+}
+
+
+// Times reps calls of zoom (after one warm-up call), returning average seconds per call
+static double time_zoom(Image *img, FILE *sink, int factor, int reps) {
+    zoom(img, sink, factor);
+    double start = now();
+    for (int r = 0; r < reps; r++) {
+        zoom(img, sink, factor);
+    }
+    return (now() - start) / reps;
+}
+
+
+/* Naive reference for bilateral: every output pixel is a weighted average
+ * over a (4 sigma_s + 1)^2 window, weighted by distance and by difference
+ * in luminance, leaving out pixels beyond the border */
+static Image *naive_bilateral(const Image *img, float sigma_s, float sigma_r) {
+    Image *out = make_image(img->rows, img->cols);
+    if (!out) {
+        return NULL;
+    }
+    int r = (int) ceil(2 * sigma_s);
+
+    for (int i = 0; i < img->rows; i++) {
+        for (int j = 0; j < img->cols; j++) {
+            const Pixel *c = IMAGE_ROW(img, i) + j;
+            double gray = pixel_to_gray(c);
+            double sum[4] = { 0, 0, 0, 0 };
+            for (int m = MAX(i - r, 0); m <= i + r && m < img->rows; m++) {
+                for (int l = MAX(j - r, 0); l <= j + r && l < img->cols; l++) {
+                    const Pixel *p = IMAGE_ROW(img, m) + l;
+                    double d = pixel_to_gray(p) - gray;
+                    double w = exp(-(sq(m - i) + sq(l - j)) /
+                                   (2.0 * sigma_s * sigma_s)
+                                   - d * d / (2.0 * sigma_r * sigma_r));
+                    sum[0] += w * p->r;
+                    sum[1] += w * p->g;
+                    sum[2] += w * p->b;
+                    sum[3] += w;
+                }
+            }
+            Pixel *o = IMAGE_ROW(out, i) + j;
+            o->r = sum[0] / sum[3] + 0.5;
+            o->g = sum[1] / sum[3] + 0.5;
+            o->b = sum[2] / sum[3] + 0.5;
+        }
+    }
+    return out;
+}
+
+
+/* Naive reference for motion_blur: every output pixel averages the
+ * samples of its own line, leaving out those beyond the border */
+static Image *naive_motion_blur(const Image *img, float length, float angle) {
+    Image *out = make_image(img->rows, img->cols);
+    if (!out) {
+        return NULL;
+    }
+    double dx = cos(angle * PI / 180);
+    double dy = -sin(angle * PI / 180);
+    double major = MAX(fabs(dx), fabs(dy));
+    int r = (int) ((length * major - 1) / 2 + 0.5);
+
+    for (int i = 0; i < img->rows; i++) {
+        for (int j = 0; j < img->cols; j++) {
+            long sum[3] = { 0, 0, 0 };
+            long count = 0;
+            for (int t = -r; t <= r; t++) {
+                int y = i + (int) floor(t * dy / major + 0.5);
+                int x = j + (int) floor(t * dx / major + 0.5);
+                if (y >= 0 && y < img->rows && x >= 0 && x < img->cols) {
+                    const Pixel *p = IMAGE_ROW(img, y) + x;
+                    sum[0] += p->r;
+                    sum[1] += p->g;
+                    sum[2] += p->b;
+                    count++;
+                }
+            }
+            Pixel *o = IMAGE_ROW(out, i) + j;
+            o->r = (sum[0] + count / 2) / count;
+            o->g = (sum[1] + count / 2) / count;
+            o->b = (sum[2] + count / 2) / count;
+        }
+    }
+    return out;
+}
+
+
+// Bilateral spatial sigmas (range sigma 20) and motion blur lengths
+// (angle 30) timed against the naive references
+static const float bilateral_sigmas[] = { 2, 4, 8 };
+#define NUM_BILATERAL (sizeof(bilateral_sigmas) / sizeof(bilateral_sigmas[0]))
+
+static const float motion_lengths[] = { 5, 15, 45 };
+#define NUM_MOTION (sizeof(motion_lengths) / sizeof(motion_lengths[0]))
+
+
+/* Runs bilateral (motion is 0) or motion_blur (motion is 1) with the given
+ * parameters and reads the result back; NULL on failure */
+static Image *fast_filter(Image *img, int motion, float a, float b) {
+    FILE *tmp = tmpfile();
+    if (!tmp) {
+        return NULL;
+    }
+    int ok = motion ? motion_blur(img, tmp, a, b) : bilateral(img, tmp, a, b);
+    Image *out = NULL;
+    if (ok > 0) {
+        rewind(tmp);
+        out = read_ppm(tmp);
+    }
+    fclose(tmp);
+    return out;
+}
+
+
+/* Times the fast filter (average of reps, after the call that produces
+ * its output) and the naive reference (once), and prints both with the
+ * PSNR between their outputs */
+static void compare_filter(Image *img, FILE *sink, int motion, float a,
+                           float b, int reps) {
+    Image *fast = fast_filter(img, motion, a, b);
+    double start = now();
+    for (int r = 0; r < reps; r++) {
+        if (motion) {
+            motion_blur(img, sink, a, b);
+        } else {
+            bilateral(img, sink, a, b);
+        }
+    }
+    double fast_time = (now() - start) / reps;
+
+    start = now();
+    Image *naive = motion ? naive_motion_blur(img, a, b)
+                          : naive_bilateral(img, a, b);
+    double naive_time = now() - start;
+
+    ImageDiff diff;
+    diff.psnr = NAN;
+    if (fast && naive) {
+        diff_images(fast, naive, &diff, NULL);
+    }
+    printf("%-11s %4g %12.2f %12.2f %7.2fx %9.2f\n",
+           motion ? "motion-blur" : "bilateral", a, naive_time * 1e3,
+           fast_time * 1e3, naive_time / fast_time, diff.psnr);
+
+    if (fast) {
+        free_image(&fast);
+    }
+    if (naive) {
+        free_image(&naive);
+    }
+}
+
+
+// Times reps calls of median (after one warm-up call), returning average seconds per call
+static double time_median(Image *img, FILE *sink, int radius, int reps) {
+    median(img, sink, radius);
+    double start = now();
+    for (int r = 0; r < reps; r++) {
+        median(img, sink, radius);
+    }
+    return (now() - start) / reps;
+}
+
+
+/* The hot loops as they were indexed before pixel offsets were computed in
+ * size_t (int products of row and column), to time against the library's
+ * size_t indexing; they give the same output. Each writes its result to out.
+ */
+enum { HOT_BINARIZE, HOT_ROTATE_LEFT, HOT_ZOOM, HOT_BLUR, NUM_HOT };
+static const char *hot_names[] = { "binarize", "rotate-left", "zoom 3x",
+                                   "blur 7 taps" };
+#define HOT_ZOOM_FACTOR 3
+#define HOT_BLUR_SIGMA 0.7f
+
+
+static int int_binarize(Image *img, FILE *out, int threshold) {
+    for (int i = 0; i < img->rows; i++) {
+        for (int j = 0; j < img->cols; j++) {
+            int k = i*img->cols + j;
+            unsigned char v = pixel_to_gray(&img->data[k]) < threshold ? 0 : 255;
+            img->data[k].r = v;
+            img->data[k].g = v;
+            img->data[k].b = v;
+        }
+    }
+    return write_ppm(out, img);
+}
+
+
+static int int_rotate_left(const Image *img, FILE *out) {
+    Image *img2 = make_image(img->cols, img->rows);
+    if (!img2) {
+        return 0;
+    }
+    for (int i = 0; i < img->rows; i++) {
+        for (int j = 0; j < img->cols; j++) {
+            int k1 = i*img->cols + j;
+            int k2 = (img->cols - 1 - j)*img2->cols + i;
+            img2->data[k2] = img->data[k1];
+        }
+    }
+    int result = write_ppm(out, img2);
+    free_image(&img2);
+    return result;
+}
+
+
+static int int_zoom(const Image *img, FILE *out, int factor) {
+    Image *img2 = make_image(factor * img->rows, factor * img->cols);
+    if (!img2) {
+        return 0;
+    }
+    for (int i = 0; i < img->rows; i++) {
+        Pixel *dst = img2->data + (factor * i) * img2->cols;
+        const Pixel *src = img->data + i * img->cols;
+        for (int j = 0; j < img->cols; j++) {
+            for (int f = 0; f < factor; f++) {
+                dst[j * factor + f] = src[j];
+            }
+        }
+        for (int f = 1; f < factor; f++) {
+            memcpy(dst + f * img2->cols, dst, img2->cols * sizeof(Pixel));
+        }
+    }
+    int result = write_ppm(out, img2);
+    free_image(&img2);
+    return result;
+}
+
+
+static int int_blur(const Image *img, FILE *out, float sigma) {
+    const Kernel *k = kernel_acquire(sigma, KERNEL_EXACT);
+    Image *img2 = make_image(img->rows, img->cols);
+    if (!k || !img2) {
+        if (k) {
+            kernel_release(k);
+        }
+        free_image(&img2);
+        return 0;
+    }
+    int n = k->n;
+    for (int i = 0; i < img->rows; i++) {
+        for (int j = 0; j < img->cols; j++) {
+            double sum = 0, avg_r = 0, avg_g = 0, avg_b = 0;
+            for (int m = 0; m < n; m++) {
+                for (int l = 0; l < n; l++) {
+                    int row = i - n/2 + m;
+                    int col = j - n/2 + l;
+                    if (row >= 0 && row < img->rows && col >= 0 &&
+                        col < img->cols) {
+                        const Pixel *p = &img->data[row*img->cols + col];
+                        double w = k->weights2d[m*n + l];
+                        sum += w;
+                        avg_r += p->r*w;
+                        avg_g += p->g*w;
+                        avg_b += p->b*w;
+                    }
+                }
+            }
+            Pixel *q = &img2->data[i*img->cols + j];
+            q->r = avg_r/sum;
+            q->g = avg_g/sum;
+            q->b = avg_b/sum;
+        }
+    }
+    kernel_release(k);
+    int result = write_ppm(out, img2);
+    free_image(&img2);
+    return result;
+}
+
+
+/* Runs hot loop which on img through the library (size_t indexing) or the
+ * int-indexed reference, writing the result to out; binarize works on a
+ * copy, since it overwrites its input. Returns 0 on failure */
+static int run_hot(int which, Image *img, FILE *out, int int_index) {
+    switch (which) {
+    case HOT_BINARIZE: {
+        Image *copy = make_copy(img);
+        int result = 0;
+        if (copy) {
+            result = int_index ? int_binarize(copy, out, 128)
+                               : binarize(copy, out, 128);
+            free_image(&copy);
+        }
+        return result;
+    }
+    case HOT_ROTATE_LEFT:
+        return int_index ? int_rotate_left(img, out) : rotate_left(img, out);
+    case HOT_ZOOM:
+        return int_index ? int_zoom(img, out, HOT_ZOOM_FACTOR)
+                         : zoom(img, out, HOT_ZOOM_FACTOR);
+    case HOT_BLUR:
+        return int_index ? int_blur(img, out, HOT_BLUR_SIGMA)
+                         : blur(img, out, HOT_BLUR_SIGMA);
+    }
+    return 0;
+}
+
+
+// Runs hot loop which into a temporary file and reads the result back
+static Image *hot_output(int which, Image *img, int int_index) {
+    FILE *tmp = tmpfile();
+    if (!tmp) {
+        return NULL;
+    }
+    Image *out = NULL;
+    if (run_hot(which, img, tmp, int_index) > 0) {
+        rewind(tmp);
+        out = read_ppm(tmp);
+    }
+    fclose(tmp);
+    return out;
+}
+
+
+/* Times the hot loops (average of reps, after a warm-up call) with int and
+ * with size_t indexing, single-threaded and on the generic code paths so
+ * only the indexing differs, and checks the outputs match */
+static void compare_indexing(Image *img, FILE *sink, int reps) {
+    // The int references can only index images whose outputs have fewer
+    // than INT_MAX pixels
+    long long pixels = (long long) img->rows * img->cols;
+    if (pixels * HOT_ZOOM_FACTOR * HOT_ZOOM_FACTOR > INT_MAX) {
+        printf("\nimage too large for the int-indexed references\n");
+        return;
+    }
+
+    const char *threads = getenv("PHOTO_THREADS");
+    char *saved = threads ? strdup(threads) : NULL;
+    setenv("PHOTO_THREADS", "1", 1);
+    use_specialized_kernels(0);
+
+    printf("\n%-14s %12s %12s %8s %6s\n", "indexing", "int ms",
+           "size_t ms", "ratio", "same");
+    for (int which = 0; which < NUM_HOT; which++) {
+        double time[2];
+        for (int int_index = 0; int_index < 2; int_index++) {
+            run_hot(which, img, sink, int_index);
+            double start = now();
+            for (int r = 0; r < reps; r++) {
+                run_hot(which, img, sink, int_index);
+            }
+            time[int_index] = (now() - start) / reps;
+        }
+
+        Image *a = hot_output(which, img, 0);
+        Image *b = hot_output(which, img, 1);
+        int same = a && b && images_equal(a, b);
+        free_image(&a);
+        free_image(&b);
+
+        printf("%-14s %12.2f %12.2f %7.2fx %6s\n", hot_names[which],
+               time[1] * 1e3, time[0] * 1e3, time[0] / time[1],
+               same ? "yes" : "NO");
+    }
+
+    use_specialized_kernels(1);
+    if (saved) {
+        setenv("PHOTO_THREADS", saved, 1);
+        free(saved);
+    } else {
+        unsetenv("PHOTO_THREADS");
+    }
+}
+
+
+// Operations whose peak memory is compared with and without in-place mode
+static const char *rss_ops[] = { "blur", "crop", "rotate-left", "zoom_in",
+                                 "pointillism" };
+#define NUM_RSS_OPS (sizeof(rss_ops) / sizeof(rss_ops[0]))
+
+
+// Runs the named operation (with a fixed set of arguments)
+static void run_op(Image *img, FILE *sink, const char *op) {
+    if (strcmp(op, "blur") == 0) {
+        blur(img, sink, 2.0f);
+    } else if (strcmp(op, "crop") == 0) {
+        crop(img, sink, img->cols / 4, img->rows / 4, img->cols,
+             img->rows);
+    } else if (strcmp(op, "rotate-left") == 0) {
+        rotate_left(img, sink);
+    } else if (strcmp(op, "zoom_in") == 0) {
+        zoom_in(img, sink);
+    } else if (strcmp(op, "pointillism") == 0) {
+        pointillism(img, sink);
+    }
+}
+
+
+/* Loads the input and runs op in a child process, so each measurement
+ * starts from a fresh peak; threads, if not NULL, overrides PHOTO_THREADS.
+ * Returns how far (in KB) the op raised the child's peak RSS above where
+ * it was once the image was loaded, or -1
+ */
+static long peak_rss(const char *input, const char *op, int in_place,
+                     const char *threads) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        long peak = -1;
+        if (threads) {
+            setenv("PHOTO_THREADS", threads, 1);
+        }
+        FILE *fp = fopen(input, "rb");
+        FILE *sink = fopen("/dev/null", "wb");
+        Image *img = fp ? read_ppm(fp) : NULL;
+        if (img && sink) {
+            struct rusage usage;
+            getrusage(RUSAGE_SELF, &usage);
+            long loaded = usage.ru_maxrss;
+
+            use_in_place(in_place);
+            run_op(img, sink, op);
+
+            getrusage(RUSAGE_SELF, &usage);
+            peak = usage.ru_maxrss - loaded;
+        }
+        if (write(fds[1], &peak, sizeof(peak)) != sizeof(peak)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+
+    long peak = -1;
+    close(fds[1]);
+    if (read(fds[0], &peak, sizeof(peak)) != sizeof(peak)) {
+        peak = -1;
+    }
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+
+    return peak;
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *input = argc > 1 ? argv[1] : "data/kitten.ppm";
+    int reps = argc > 2 ? atoi(argv[2]) : 3;
+    if (reps < 1) {
+        reps = 1;
+    }
+
+    // Peak memory is measured first, while this process is still small
+    // (scratch space that grows with the thread count shows up at 64)
+    printf("%-14s %12s %12s %14s\n", "peak RSS rise", "copy KB",
+           "in-place KB", "64 threads KB");
+    for (size_t o = 0; o < NUM_RSS_OPS; o++) {
+        printf("%-14s %12ld %12ld %14ld\n", rss_ops[o],
+               peak_rss(input, rss_ops[o], 0, NULL),
+               peak_rss(input, rss_ops[o], 1, NULL),
+               peak_rss(input, rss_ops[o], 1, "64"));
+    }
+    printf("\n");
+
+    FILE *fp = fopen(input, "rb");
+    if (!fp) {
+        fprintf(stderr, "Unable to read %s\n", input);
+        return 1;
+    }
+    Image *img = read_ppm(fp);
+    fclose(fp);
+    if (!img) {
+        fprintf(stderr, "Input file cannot be read as a ppm\n");
+        return 1;
+    }
+
+    FILE *sink = fopen("/dev/null", "wb");
+    if (!sink) {
+        fprintf(stderr, "Unable to open /dev/null\n");
+        free_image(&img);
+        return 1;
+    }
+
+    printf("%s: %d x %d, %d repetitions\n\n", input, img->cols, img->rows,
+           reps);
+
+    printf("%-14s %12s %12s %8s\n", "kernel", "generic ms", "special ms",
+           "speedup");
+    for (size_t s = 0; s < NUM_SIGMAS; s++) {
+        float sigma = blur_sigmas[s];
+        int n = 10*sigma;
+        n += (n%2 == 0);
+
+        use_specialized_kernels(0);
+        double generic = time_blur(img, sink, sigma, reps);
+        use_specialized_kernels(1);
+        double special = time_blur(img, sink, sigma, reps);
+
+        printf("blur %2d taps  %12.2f %12.2f %7.2fx\n", n, generic * 1e3,
+               special * 1e3, generic / special);
+    }
+    for (size_t f = 0; f < NUM_FACTORS; f++) {
+        int factor = zoom_factors[f];
+
+        use_specialized_kernels(0);
+        double generic = time_zoom(img, sink, factor, reps);
+        use_specialized_kernels(1);
+        double special = time_zoom(img, sink, factor, reps);
+
+        printf("zoom %dx        %12.2f %12.2f %7.2fx\n", factor,
+               generic * 1e3, special * 1e3, generic / special);
+    }
+
+    printf("\n%-11s %4s %12s %12s %8s %9s\n", "filter", "size", "naive ms",
+           "fast ms", "speedup", "PSNR dB");
+    for (size_t b = 0; b < NUM_BILATERAL; b++) {
+        compare_filter(img, sink, 0, bilateral_sigmas[b], 20, reps);
+    }
+    for (size_t m = 0; m < NUM_MOTION; m++) {
+        compare_filter(img, sink, 1, motion_lengths[m], 30, reps);
+    }
+    for (size_t m = 0; m < NUM_RADII; m++) {
+        int radius = median_radii[m];
+
+        use_specialized_kernels(0);
+        double generic = time_median(img, sink, radius, reps);
+        use_specialized_kernels(1);
+        double special = time_median(img, sink, radius, reps);
+
+        printf("median r=%-2d   %12.2f %12.2f %7.2fx\n", radius,
+               generic * 1e3, special * 1e3, generic / special);
+    }
+
+    compare_indexing(img, sink, reps);
+
+    KernelCacheStats stats;
+    kernel_cache_stats(&stats);
+    printf("\nkernel cache: %lu hits, %lu misses, %lu evictions, "
+           "%zu entries, %zu bytes\n", stats.hits, stats.misses,
+           stats.evictions, stats.entries, stats.bytes);
+
+    fclose(sink);
+    free_image(&img);
+
+    return 0;
+}
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include "ppm_io.h"
+
+
+/* Synthetic test-image generator, for reproducible benchmarks at any size.
+ * Images are generated and written one row at a time, so memory use
+ * depends only on the width, and gigapixel images can be produced.
+ *
+ * USAGE: ./checkerboard <output-image> <cols> <rows> <pattern> [<param>]
+ *
+ * Patterns, and what their optional parameter means:
+ *   checkerboard [square]  black and white squares, square pixels wide
+ *                          (default 8); the top-left square is black
+ *   gradient               red ramps 0-255 left to right, green ramps
+ *                          top to bottom, blue is their average
+ *   noise [seed]           uniformly random channels (default seed 1);
+ *                          the same seed always gives the same image
+ *   stripes [period]       vertical black/white stripes period pixels
+ *                          wide (default 1: alternating pixels)
+ *   zoneplate [scale]      concentric rings whose frequency rises
+ *                          towards the edges (default scale 1)
+ *   solid [value]          every channel set to value (default 128)
+ *
+ * square and period are from 1 to INT_MAX, seed is not negative, value
+ * is 0-255, and scale can be any number; other parameters are rejected.
+ */
+
+
+// Return (exit) codes
+#define RC_SUCCESS            0
+#define RC_INVALID_ARGS       1
+#define RC_OPEN_FAILED        2
+#define RC_WRITE_FAILED       3
+
+
+void print_usage();
+
+
+/* struct to store what a pattern needs to generate its rows */
+typedef struct _pattern {
+    const char *name;
+    double param;               // zoneplate's scale
+    long long value;            // the other patterns' integer parameter
+    int rows;
+    int cols;
+    unsigned long long state;   // noise generator state
+} Pattern;
+
+
+// xorshift64* generator, for noise that's fast and fully reproducible
+static unsigned long long next_random(unsigned long long *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+
+/* Parses str as a whole integer in [lo, hi] into value;
+ * returns -1 if it isn't one */
+static int parse_int(const char *str, long long lo, long long hi,
+                     long long *value) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(str, &end, 10);
+    if (end == str || *end != '\0' || errno == ERANGE || v < lo || v > hi) {
+        return -1;
+    }
+    *value = v;
+    return 0;
+}
+
+
+
+// Fills row i of the pattern
+static void make_row(Pattern *p, int i, Pixel *row) {
+    int cols = p->cols;
+
+    if (strcmp(p->name, "checkerboard") == 0) {
+        long long square = p->value;
+        for (int j = 0; j < cols; j++) {
+            unsigned char v = ((i / square + j / square) % 2) ? 255 : 0;
+            row[j].r = row[j].g = row[j].b = v;
+        }
+    } else if (strcmp(p->name, "gradient") == 0) {
+        unsigned char g = p->rows > 1 ? (long long) i * 255 / (p->rows - 1) : 0;
+        for (int j = 0; j < cols; j++) {
+            unsigned char r = cols > 1 ? (long long) j * 255 / (cols - 1) : 0;
+            row[j].r = r;
+            row[j].g = g;
+            row[j].b = (r + g) / 2;
+        }
+    } else if (strcmp(p->name, "noise") == 0) {
+        for (int j = 0; j < cols; j++) {
+            unsigned long long bits = next_random(&p->state);
+            row[j].r = bits >> 40;
+            row[j].g = bits >> 48;
+            row[j].b = bits >> 56;
+        }
+    } else if (strcmp(p->name, "stripes") == 0) {
+        long long period = p->value;
+        for (int j = 0; j < cols; j++) {
+            unsigned char v = ((j / period) % 2) ? 255 : 0;
+            row[j].r = row[j].g = row[j].b = v;
+        }
+    } else if (strcmp(p->name, "zoneplate") == 0) {
+        // Phase grows with the squared distance from the center, so the
+        // ring frequency grows linearly, reaching one cycle every two
+        // pixels (times scale) at the edges
+        double y = i - p->rows / 2.0;
+        double extent = p->rows > cols ? p->rows : cols;
+        double k = p->param * 3.14159265358979323846 / extent;
+        for (int j = 0; j < cols; j++) {
+            double x = j - cols / 2.0;
+            unsigned char v = 127.5 + 127.5 * cos(k * (x * x + y * y));
+            row[j].r = row[j].g = row[j].b = v;
+        }
+    } else {
+        unsigned char v = p->value;
+        for (int j = 0; j < cols; j++) {
+            row[j].r = row[j].g = row[j].b = v;
+        }
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    if (argc != 5 && argc != 6) {
+        print_usage();
+        return RC_INVALID_ARGS;
+    }
+
+    Pattern p;
+    p.cols = atoi(argv[2]);
+    p.rows = atoi(argv[3]);
+    p.name = argv[4];
+
+    // Default parameters and their allowed ranges, by pattern; zoneplate's
+    // scale is the one that isn't an integer
+    static const char *names[] = { "checkerboard", "gradient", "noise",
+                                   "stripes", "zoneplate", "solid" };
+    static const double defaults[] = { 8, 0, 1, 1, 1, 128 };
+    static const long long lows[] = { 1, 0, 0, 1, 0, 0 };
+    static const long long highs[] = { INT_MAX, 0, LLONG_MAX, INT_MAX, 0, 255 };
+    int known = -1;
+    for (int n = 0; n < 6; n++) {
+        if (strcmp(p.name, names[n]) == 0) {
+            known = n;
+        }
+    }
+    if (known < 0 || p.cols <= 0 || p.rows <= 0) {
+        fprintf(stderr, "Invalid arguments\n");
+        print_usage();
+        return RC_INVALID_ARGS;
+    }
+    p.param = defaults[known];
+    p.value = defaults[known];
+    int bad_param = 0;
+    if (argc == 6 && known == 4) {
+        char *end;
+        p.param = strtod(argv[5], &end);
+        bad_param = end == argv[5] || *end != '\0' || !isfinite(p.param);
+    } else if (argc == 6 && known != 1) {
+        bad_param = parse_int(argv[5], lows[known], highs[known], &p.value) != 0;
+    }
+    if (bad_param) {
+        fprintf(stderr, "Invalid arguments\n");
+        return RC_INVALID_ARGS;
+    }
+    p.state = (unsigned long long) p.value * 0x9E3779B97F4A7C15ULL + 1;
+
+    FILE *fp = fopen(argv[1], "wb");
+    if (!fp) {
+        fprintf(stderr, "Unable to write\n");
+        return RC_OPEN_FAILED;
+    }
+
+    Pixel *row = malloc(sizeof(Pixel) * p.cols);
+    if (!row) {
+        fprintf(stderr, "Out of memory\n");
+        fclose(fp);
+        return RC_WRITE_FAILED;
+    }
+
+    // Streams the image out a row at a time
+    int rc = RC_SUCCESS;
+    if (write_ppm_header(fp, p.rows, p.cols) != 0) {
+        rc = RC_WRITE_FAILED;
+    }
+    for (int i = 0; i < p.rows && rc == RC_SUCCESS; i++) {
+        make_row(&p, i, row);
+        if (write_ppm_pixels(fp, row, p.cols) != (size_t) p.cols) {
+            rc = RC_WRITE_FAILED;
+        }
+    }
+    if (fclose(fp) != 0) {
+        rc = RC_WRITE_FAILED;
+    }
+    free(row);
+
+    if (rc != RC_SUCCESS) {
+        fprintf(stderr, "Could not write\n");
+    }
+    return rc;
+}
+
+
+void print_usage() {
+    printf("USAGE: ./checkerboard <output-image> <cols> <rows> <pattern> [<param>]\n");
+    printf("SUPPORTED PATTERNS:\n");
+    printf("   checkerboard [<square-size>]\n");
+    printf("   gradient\n");
+    printf("   noise [<seed>]\n");
+    printf("   stripes [<period>]\n");
+    printf("   zoneplate [<scale>]\n");
+    printf("   solid [<value>]\n");
+}
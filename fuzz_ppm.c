@@ -0,0 +1,303 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "ppm_io.h"
+#include "image_manip.h"
+
+
+/* Fuzz target for read_ppm and the image operations.
+ *
+ * Each input is a few control bytes followed by a PPM file: the first
+ * byte picks the operation, the next picks in-place mode and the
+ * specialized kernels, and the six after that are the operation's
+ * parameters. The rest is read with read_ppm (or streamed through
+ * binarize_stream, or parsed as a convolution kernel) and the result is
+ * written to /dev/null. Memory errors and undefined behavior are caught
+ * by the sanitizers the target is built with.
+ *
+ * Built with -DUSE_LIBFUZZER (and -fsanitize=fuzzer), only
+ * LLVMFuzzerTestOneInput is defined, for libFuzzer to drive. Otherwise
+ * main runs the target on each file named on the command line (so AFL
+ * can drive it with @@), on stdin if there are none, or with
+ *     ./fuzz_ppm -random <count> [<seed>]
+ * on that many generated inputs: mostly valid PPMs of random size, some
+ * truncated or with a corrupted header. Each generated input is saved
+ * to fuzz-case.bin before it runs, so after a crash it can be rerun.
+ */
+
+
+// Number of control bytes before the image
+#define CONTROL_BYTES 8
+
+// Images are kept small so each input runs quickly
+#define MAX_PIXELS (64 * 64)
+
+enum {
+    OP_BINARIZE, OP_BINARIZE_PACKED, OP_BINARIZE_STREAM, OP_CROP, OP_ZOOM_IN,
+    OP_ZOOM, OP_ROTATE_LEFT, OP_ROTATE, OP_AFFINE, OP_POINTILLISM, OP_BLUR,
+    OP_CONVOLVE, OP_READ_KERNEL, OP_SHARPEN, OP_UNSHARP, OP_BILATERAL,
+    OP_MOTION_BLUR, OP_MEDIAN, OP_SOBEL, OP_STATS, OP_EQUALIZE, OP_COMPARE,
+    NUM_OPS
+};
+
+
+// Maps a control byte onto [lo, hi]
+static float byte_range(uint8_t b, float lo, float hi) {
+    return lo + (hi - lo) * b / 255.0f;
+}
+
+
+// Runs the operation picked by the control bytes on the image
+static void run_op(int op, const uint8_t *p, Image *img, FILE *out) {
+    switch (op) {
+    case OP_BINARIZE:
+        binarize(img, out, byte_range(p[0], -0.5f, 1.5f));
+        break;
+    case OP_BINARIZE_PACKED:
+        binarize_packed(img, out, byte_range(p[0], -0.5f, 1.5f),
+                        p[1] & 1 ? BINARY_PGM : BINARY_PBM);
+        break;
+    case OP_CROP:
+        // Lets the corners run a little past the image on both sides
+        crop(img, out, p[0] % (img->cols + 2) - 1, p[1] % (img->rows + 2) - 1,
+             p[2] % (img->cols + 2) - 1, p[3] % (img->rows + 2) - 1);
+        break;
+    case OP_ZOOM_IN:
+        zoom_in(img, out);
+        break;
+    case OP_ZOOM:
+        zoom(img, out, p[0] % 7 - 1);
+        break;
+    case OP_ROTATE_LEFT:
+        rotate_left(img, out);
+        break;
+    case OP_ROTATE:
+        // Every eighth input lands on an exact quarter turn
+        rotate(img, out, p[0] & 7 ? byte_range(p[1], -720, 720) : 90 * (p[1] % 9 - 4),
+               p[2] & 1 ? INTERP_BILINEAR : INTERP_NEAREST);
+        break;
+    case OP_AFFINE: {
+        double m[6];
+        m[0] = byte_range(p[0], -3, 3);
+        m[1] = byte_range(p[1], -3, 3);
+        m[2] = byte_range(p[2], -100, 100);
+        m[3] = byte_range(p[3], -3, 3);
+        m[4] = byte_range(p[4], -3, 3);
+        m[5] = byte_range(p[5], -100, 100);
+        affine(img, out, m, p[5] & 1 ? INTERP_BILINEAR : INTERP_NEAREST);
+        break;
+    }
+    case OP_POINTILLISM:
+        pointillism(img, out);
+        break;
+    case OP_BLUR:
+        blur(img, out, byte_range(p[0], -1, 6));
+        break;
+    case OP_CONVOLVE: {
+        ConvKernel *k = make_conv_kernel(1 + 2 * (p[0] % 4), 1 + 2 * (p[1] % 4));
+        if (k) {
+            for (int i = 0; i < k->width * k->height; i++) {
+                k->weights[i] = byte_range(p[2 + i % 4], -2, 2);
+            }
+            convolve(img, out, k, (BorderMode) (p[5] % 4));
+            free_conv_kernel(&k);
+        }
+        break;
+    }
+    case OP_SHARPEN:
+        sharpen(img, out);
+        break;
+    case OP_UNSHARP:
+        unsharp(img, out, byte_range(p[0], -1, 6), byte_range(p[1], -1, 4));
+        break;
+    case OP_BILATERAL:
+        bilateral(img, out, byte_range(p[0], 0, 24), byte_range(p[1], 0, 128));
+        break;
+    case OP_MOTION_BLUR:
+        motion_blur(img, out, byte_range(p[0], 0, 80), byte_range(p[1], -360, 360));
+        break;
+    case OP_MEDIAN:
+        median(img, out, p[0] % 132 - 2);
+        break;
+    case OP_SOBEL:
+        sobel(img, out);
+        break;
+    case OP_STATS:
+        stats(img, out, p[0] & 1);
+        break;
+    case OP_EQUALIZE:
+        equalize(img, out);
+        break;
+    case OP_COMPARE: {
+        // Compares against a copy with one pixel changed
+        Image *img2 = make_copy(img);
+        if (img2) {
+            img2->data[p[0] % img2->rows * img2->cols + p[1] % img2->cols].r ^= p[2];
+            compare(img, out, img2);
+            free_image(&img2);
+        }
+        break;
+    }
+    }
+}
+
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size < CONTROL_BYTES) {
+        return 0;
+    }
+    int op = data[0] % NUM_OPS;
+    use_in_place(data[1] & 1);
+    use_specialized_kernels(!(data[1] & 2));
+    const uint8_t *p = data + 2;
+
+    FILE *in = fmemopen((void *) (data + CONTROL_BYTES), size - CONTROL_BYTES, "rb");
+    FILE *out = fopen("/dev/null", "wb");
+    if (!in || !out) {
+        if (in) fclose(in);
+        if (out) fclose(out);
+        return 0;
+    }
+
+    if (op == OP_READ_KERNEL) {
+        ConvKernel *k = read_conv_kernel(in);
+        free_conv_kernel(&k);
+    } else {
+        // Skips images too big to run quickly, before reading them
+        int rows, cols;
+        if (read_ppm_header(in, &rows, &cols) == 0 &&
+                (long long) rows * cols <= MAX_PIXELS) {
+            rewind(in);
+            if (op == OP_BINARIZE_STREAM) {
+                binarize_stream(in, out, byte_range(p[0], -0.5f, 1.5f),
+                                p[1] & 1 ? BINARY_PGM : BINARY_PBM);
+            } else {
+                Image *img = read_ppm(in);
+                if (img) {
+                    run_op(op, p, img, out);
+                    free_image(&img);
+                }
+            }
+        }
+    }
+
+    fclose(in);
+    fclose(out);
+    return 0;
+}
+
+
+#ifndef USE_LIBFUZZER
+
+// Runs the target on a whole file; returns -1 if it can't be read
+static int run_file(FILE *fp) {
+    size_t size = 0, capacity = 4096;
+    uint8_t *data = malloc(capacity);
+    size_t got;
+    while (data && (got = fread(data + size, 1, capacity - size, fp)) > 0) {
+        size += got;
+        if (size == capacity) {
+            uint8_t *grown = realloc(data, capacity * 2);
+            if (!grown) {
+                free(data);
+            }
+            data = grown;
+            capacity *= 2;
+        }
+    }
+    if (!data) {
+        return -1;
+    }
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+
+// Fills buf with a random input of at most capacity bytes; returns its size
+static size_t random_case(uint8_t *buf, size_t capacity) {
+    for (int i = 0; i < CONTROL_BYTES; i++) {
+        buf[i] = rand() & 0xff;
+    }
+    int rows = 1 + rand() % 40;
+    int cols = 1 + rand() % 40;
+    size_t size = CONTROL_BYTES;
+    size += snprintf((char *) buf + size, capacity - size, "P6\n%s%d %d\n255\n",
+                     rand() % 4 ? "" : "# comment\n", cols, rows);
+    size_t pixels = (size_t) rows * cols * 3;
+    for (size_t i = 0; i < pixels && size < capacity; i++) {
+        // Mostly smooth, with some runs of extremes and whitespace bytes
+        int r = rand() % 16;
+        buf[size++] = r == 0 ? 0 : r == 1 ? 255 : r == 2 ? ' ' :
+                      (uint8_t) (i / 3 % cols * 255 / cols + rand() % 32);
+    }
+
+    // Corrupts about one input in four
+    switch (rand() % 16) {
+    case 0:
+        size = CONTROL_BYTES + rand() % (size - CONTROL_BYTES);
+        break;
+    case 1:
+        buf[CONTROL_BYTES + rand() % 12] = rand() & 0xff;
+        break;
+    case 2:
+        buf[CONTROL_BYTES + 3 + rand() % 4] = '9';
+        break;
+    case 3:
+        buf[CONTROL_BYTES + 1] = '5';
+        break;
+    }
+    return size;
+}
+
+
+int main(int argc, char *argv[]) {
+    if (argc >= 3 && strcmp(argv[1], "-random") == 0) {
+        long count = atol(argv[2]);
+        unsigned seed = argc > 3 ? (unsigned) atol(argv[3]) : 1;
+        static uint8_t buf[CONTROL_BYTES + 64 + 40 * 40 * 3];
+
+        // Keeps read errors for the corrupted inputs, and compare's
+        // report, quiet; sanitizer reports are lost too, but the failing
+        // input is in fuzz-case.bin
+        FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+        if (!report || !freopen("/dev/null", "w", stdout) ||
+                !freopen("/dev/null", "w", stderr)) {
+            return 1;
+        }
+        for (long i = 0; i < count; i++) {
+            srand(seed + i);
+            size_t size = random_case(buf, sizeof(buf));
+            FILE *saved = fopen("fuzz-case.bin", "wb");
+            if (saved) {
+                fwrite(buf, 1, size, saved);
+                fclose(saved);
+            }
+            LLVMFuzzerTestOneInput(buf, size);
+        }
+        remove("fuzz-case.bin");
+        fprintf(report, "%ld random inputs ran clean\n", count);
+        fclose(report);
+        return 0;
+    }
+
+    if (argc < 2) {
+        return run_file(stdin) ? 1 : 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+        if (!fp || run_file(fp)) {
+            fprintf(stderr, "Unable to read %s\n", argv[i]);
+            if (fp) fclose(fp);
+            return 1;
+        }
+        fclose(fp);
+    }
+    return 0;
+}
+
+#endif
@@ -2,7 +2,14 @@
 #include <stdlib.h>
 #include <math.h>
 #include <assert.h>
+#include <string.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "image_manip.h"
+#include "kernel_cache.h"
+#include "parallel.h"
 #include "ppm_io.h"
 
 
@@ -14,6 +21,22 @@ unsigned char pixel_to_gray (const Pixel *p) {
 }
 
 
+// Set to 0 to force the generic code paths (used by bench)
+static int specialized_kernels = 1;
+
+void use_specialized_kernels(int enable) {
+    specialized_kernels = enable;
+}
+
+
+// Set to 1 to have operations overwrite their input image
+static int in_place = 0;
+
+void use_in_place(int enable) {
+    in_place = enable;
+}
+
+
 int binarize(Image * img1, FILE * new_img, float thrshld) {
 
     // Checks that threshold is valid
@@ -29,7 +52,7 @@ int binarize(Image * img1, FILE * new_img, float thrshld) {
         for (int j = 0; j < img1->cols; j++) {
 
             // Flattens data array to 1d, of length num_rows * num_cols
-            int k = i*img1->cols + j;
+            size_t k = (size_t) i*img1->cols + j;
             int grayscale = pixel_to_gray(img1->data + k);
 
 	        // Converts pixel color to either black or white
@@ -54,27 +77,294 @@ int binarize(Image * img1, FILE * new_img, float thrshld) {
 
 
 
+/* HELPER for the packed binarize paths: returns nonzero if pixel p is
+ * black at the given threshold, exactly as pixel_to_gray(p) < threshold.
+ * Comparing 30r + 59g + 11b against 100 * threshold in integers agrees
+ * with the floating point version everywhere except a tie, where the
+ * rounding of pixel_to_gray has to decide */
+static int is_black(const Pixel *p, int threshold) {
+    int sum = 30 * p->r + 59 * p->g + 11 * p->b;
+    if (sum != 100 * threshold) {
+        return sum < 100 * threshold;
+    }
+    return pixel_to_gray(p) < threshold;
+}
+
+
+// Reverses the order of the bits of a byte
+static unsigned char reverse_bits(unsigned int b) {
+    b = ((b & 0xF0) >> 4) | ((b & 0x0F) << 4);
+    b = ((b & 0xCC) >> 2) | ((b & 0x33) << 2);
+    b = ((b & 0xAA) >> 1) | ((b & 0x55) << 1);
+    return (unsigned char) b;
+}
+
+
+/* Thresholds a row of cols pixels into out: for BINARY_PBM one bit per
+ * pixel, most significant first and set for black, with the last byte
+ * padded with zeros; for BINARY_PGM one byte per pixel, 0 or 255 */
+static void binarize_row(const Pixel *row, int cols, int threshold,
+                         BinaryFormat format, unsigned char *out) {
+    int j = 0;
+
+#ifdef __SSE2__
+    // 16 pixels at a time: the 48 bytes are split into separate red,
+    // green and blue vectors by riffling their two halves together (byte
+    // k moves to 2k mod 47, so four riffles take byte 3p + c to 16c + p),
+    // weighted in 16-bit lanes (at most 25500, so no overflow), compared
+    // against the threshold and packed into a 16-bit mask
+    const unsigned char *src = (const unsigned char *) row;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i limit = _mm_set1_epi16((short) (100 * threshold));
+    const __m128i wr = _mm_set1_epi16(30);
+    const __m128i wg = _mm_set1_epi16(59);
+    const __m128i wb = _mm_set1_epi16(11);
+    for (; j + 16 <= cols; j += 16) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *) (src + 3 * j));
+        __m128i a1 = _mm_loadu_si128((const __m128i *) (src + 3 * j + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i *) (src + 3 * j + 32));
+        for (int round = 0; round < 4; round++) {
+            __m128i t0 = _mm_unpacklo_epi8(a0, _mm_unpackhi_epi64(a1, a1));
+            __m128i t1 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(a0, a0), a2);
+            __m128i t2 = _mm_unpacklo_epi8(a1, _mm_unpackhi_epi64(a2, a2));
+            a0 = t0;
+            a1 = t1;
+            a2 = t2;
+        }
+
+        __m128i sum_lo = _mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpacklo_epi8(a0, zero), wr),
+            _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a1, zero), wg),
+                          _mm_mullo_epi16(_mm_unpacklo_epi8(a2, zero), wb)));
+        __m128i sum_hi = _mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpackhi_epi8(a0, zero), wr),
+            _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a1, zero), wg),
+                          _mm_mullo_epi16(_mm_unpackhi_epi8(a2, zero), wb)));
+
+        __m128i black = _mm_packs_epi16(_mm_cmplt_epi16(sum_lo, limit),
+                                        _mm_cmplt_epi16(sum_hi, limit));
+        int black_bits = _mm_movemask_epi8(black);
+        int ties = _mm_movemask_epi8(
+            _mm_packs_epi16(_mm_cmpeq_epi16(sum_lo, limit),
+                            _mm_cmpeq_epi16(sum_hi, limit)));
+
+        // Ties (rare) are settled one pixel at a time
+        for (int k = 0; ties && k < 16; k++) {
+            if (ties & (1 << k)) {
+                black_bits &= ~(1 << k);
+                if (pixel_to_gray(row + j + k) < threshold) {
+                    black_bits |= 1 << k;
+                }
+            }
+        }
+
+        if (format == BINARY_PBM) {
+            out[j / 8] = reverse_bits(black_bits & 0xFF);
+            out[j / 8 + 1] = reverse_bits(black_bits >> 8);
+        } else if (!ties) {
+            _mm_storeu_si128((__m128i *) (out + j),
+                             _mm_andnot_si128(black, _mm_set1_epi8(-1)));
+        } else {
+            for (int k = 0; k < 16; k++) {
+                out[j + k] = (black_bits & (1 << k)) ? 0 : 255;
+            }
+        }
+    }
+#endif
+
+    // j is a multiple of 8 here, so the remaining bits start a new byte
+    for (; j < cols; j++) {
+        int is_set = is_black(row + j, threshold);
+        if (format == BINARY_PBM) {
+            if (j % 8 == 0) {
+                out[j / 8] = 0;
+            }
+            if (is_set) {
+                out[j / 8] |= 0x80 >> (j % 8);
+            }
+        } else {
+            out[j] = is_set ? 0 : 255;
+        }
+    }
+}
+
+
+// Bytes per output row of the packed binarize paths
+static size_t binary_row_bytes(int cols, BinaryFormat format) {
+    return format == BINARY_PBM ? ((size_t) cols + 7) / 8 : (size_t) cols;
+}
+
+
+/* struct to store the state shared by the threads of the packed
+ * binarize paths, which each threshold their own band of rows */
+typedef struct _binarize_job {
+    const Pixel *pixels;
+    int cols;
+    int threshold;
+    BinaryFormat format;
+    unsigned char *out;
+    size_t out_stride;
+} BinarizeJob;
+
+
+static void binarize_rows(void *ctx, int begin, int end, int thread) {
+    BinarizeJob *job = ctx;
+    (void) thread;
+
+    for (int i = begin; i < end; i++) {
+        binarize_row(job->pixels + (size_t) i * job->cols, job->cols,
+                     job->threshold, job->format,
+                     job->out + (size_t) i * job->out_stride);
+    }
+}
+
+
+// Thresholds rows x cols pixels into out and writes them; returns 0 if
+// the write fails, otherwise 1
+static int write_binary_rows(FILE *new_img, const Pixel *pixels, int rows,
+                             int cols, int threshold, BinaryFormat format,
+                             unsigned char *out) {
+    BinarizeJob job;
+    job.pixels = pixels;
+    job.cols = cols;
+    job.threshold = threshold;
+    job.format = format;
+    job.out = out;
+    job.out_stride = binary_row_bytes(cols, format);
+    parallel_for(rows, binarize_rows, &job);
+
+    size_t bytes = (size_t) rows * job.out_stride;
+    return fwrite(out, 1, bytes, new_img) == bytes;
+}
+
+
+// Writes the header for the packed binarize output format
+static int write_binary_header(FILE *new_img, int rows, int cols,
+                               BinaryFormat format) {
+    return format == BINARY_PBM ? write_pbm_header(new_img, rows, cols)
+                                : write_pgm_header(new_img, rows, cols);
+}
+
+
+// Pixel count to return on success, saturating like write_ppm
+static int pixels_written(int rows, int cols) {
+    size_t count = (size_t) rows * cols;
+    return count > INT_MAX ? INT_MAX : (int) count;
+}
+
+
+
+int binarize_packed(Image * img1, FILE * new_img, float thrshld,
+                    BinaryFormat format) {
+
+    // Checks that threshold is valid
+    if (thrshld < 0 || thrshld > 255) {
+        return -1;
+    }
+    int threshold = (int)(thrshld);
+
+    unsigned char *out = malloc(binary_row_bytes(img1->cols, format) *
+                                img1->rows);
+    if (!out) {
+        return 0;
+    }
+
+    int ok = write_binary_header(new_img, img1->rows, img1->cols, format) == 0
+          && write_binary_rows(new_img, img1->data, img1->rows, img1->cols,
+                               threshold, format, out);
+    free(out);
+
+    return ok ? pixels_written(img1->rows, img1->cols) : 0;
+}
+
+
+
+// Input bytes binarize_stream reads (and thresholds) at a time
+#define BINARIZE_CHUNK (4 << 20)
+
+int binarize_stream(FILE * img_file, FILE * new_img, float thrshld,
+                    BinaryFormat format) {
+
+    // Checks that threshold is valid
+    if (thrshld < 0 || thrshld > 255) {
+        return -1;
+    }
+    int threshold = (int)(thrshld);
+
+    int rows, cols;
+    if (read_ppm_header(img_file, &rows, &cols) != 0) {
+        return -2;
+    }
+
+    // Enough whole rows to fill a chunk, and room for their output
+    size_t row_bytes = (size_t) cols * sizeof(Pixel);
+    int chunk_rows = (int) MIN((size_t) rows,
+                               MAX(BINARIZE_CHUNK / row_bytes, 1));
+    Pixel *pixels = malloc(row_bytes * chunk_rows);
+    unsigned char *out = malloc(binary_row_bytes(cols, format) * chunk_rows);
+    if (!pixels || !out) {
+        free(pixels);
+        free(out);
+        return 0;
+    }
+
+    int result = write_binary_header(new_img, rows, cols, format) == 0
+               ? pixels_written(rows, cols) : 0;
+
+    for (int i = 0; result > 0 && i < rows; i += chunk_rows) {
+        int count = MIN(chunk_rows, rows - i);
+        if (read_ppm_pixels(img_file, pixels, (size_t) count * cols) !=
+                (size_t) count * cols) {
+            fprintf(stderr, "Error:ppm_io - failed to read data from file!\n");
+            result = -2;
+        } else if (!write_binary_rows(new_img, pixels, count, cols,
+                                      threshold, format, out)) {
+            result = 0;
+        }
+    }
+
+    free(pixels);
+    free(out);
+    return result;
+}
+
+
+
 int crop(Image * img1, FILE * new_image, int upper_col, int upper_row,
             int lower_col, int lower_row) {   
-    Image * img2 = malloc(sizeof(Image));
 
     // Checks that boundary inputs are in bounds
     if (lower_row > img1->rows || lower_col > img1->cols ||
             upper_row < 0 || upper_col < 0) {
-        free_image(&img2);
         return -1;
     }
 
     // Checks that the bounds make sense in relationship to each other
     if (lower_col <= upper_col || lower_row <= upper_row) {
-        free_image(&img2);
         return -1;
     }
 
+    // In place: slides each kept row up to its final position (rows only
+    // ever move towards the front, so memmove is safe), then shrinks
+    if (in_place) {
+        int rows = lower_row - upper_row;
+        int cols = lower_col - upper_col;
+        for (int i = 0; i < rows; i++) {
+            memmove(img1->data + (size_t) i * cols,
+                    IMAGE_ROW(img1, i + upper_row) + upper_col,
+                    cols * sizeof(Pixel));
+        }
+        if (resize_image(&img1, rows, cols) != 0) {
+            return 0;
+        }
+        return write_ppm(new_image, img1);
+    }
+
     // Gets dimensions/space for cropped image
-    img2->rows = lower_row - upper_row;
-    img2->cols = lower_col - upper_col;
-    img2->data = malloc(img2->rows * img2->cols * sizeof(Pixel));
+    Image * img2 = make_image(lower_row - upper_row, lower_col - upper_col);
+    if (!img2) {
+        return 0;
+    }
 
 
     // Loops through region of interest in original image, and copies each
@@ -82,8 +372,8 @@ int crop(Image * img1, FILE * new_image, int upper_col, int upper_row,
     for (int i = 0; i < img2->rows; i++) {
         for (int j = 0; j < img2->cols; j++) {
 
-            int k1 = (i + upper_row) * img1->cols + j + upper_col;
-            int k2 = i * img2->cols + j;
+            size_t k1 = (size_t) (i + upper_row) * img1->cols + j + upper_col;
+            size_t k2 = (size_t) i * img2->cols + j;
 
 	        // Modifies data
             img2->data[k2] = img1->data[k1];
@@ -100,29 +390,105 @@ int crop(Image * img1, FILE * new_image, int upper_col, int upper_row,
 
 
 
-int zoom_in(Image * img1, FILE * new_image) {
-    Image * img2 = malloc(sizeof(Image));
+/* Row expanders for zoom: each source pixel is repeated F times along the
+ * output row. ZOOM_ROW(name, F) stamps out a copy with F fixed at compile
+ * time so the inner loop is fully unrolled; the generic version passes the
+ * runtime factor through as F.
+ */
+#define ZOOM_ROW(NAME, F)                                                   \
+static void NAME(const Pixel *src, Pixel *dst, int cols, int factor) {    \
+    (void) factor;                                                          \
+    for (int j = 0; j < cols; j++) {                                        \
+        for (int f = 0; f < (F); f++) {                                     \
+            dst[(size_t) j * (F) + f] = src[j];                             \
+        }                                                                   \
+    }                                                                       \
+}
+
+ZOOM_ROW(zoom_row_2, 2)
+ZOOM_ROW(zoom_row_3, 3)
+ZOOM_ROW(zoom_row_4, 4)
+ZOOM_ROW(zoom_row_generic, factor)
+
+
+/* HELPER for zoom:
+ * zoom in place by growing the pixel buffer and expanding rows from the
+ * last one backwards; for every row but the first, its output block
+ * starts past the end of the row itself and only covers rows that have
+ * already been expanded
+ */
+static int zoom_in_place(Image *img1, FILE *new_image, int factor,
+                         void (*expand)(const Pixel *, Pixel *, int, int)) {
+    int rows = img1->rows;
+    int cols = img1->cols;
+
+    // Row 0's block overlaps it, so it's expanded from a copy
+    Pixel *first = malloc(cols * sizeof(Pixel));
+    if (!first) {
+        return 0;
+    }
+    memcpy(first, img1->data, cols * sizeof(Pixel));
+
+    if (resize_image(&img1, factor * rows, factor * cols) != 0) {
+        free(first);
+        return 0;
+    }
+
+    for (int i = rows - 1; i >= 0; i--) {
+        Pixel *dst = IMAGE_ROW(img1, factor * i);
+        expand(i ? img1->data + (size_t) i * cols : first, dst, cols, factor);
+
+        for (int f = 1; f < factor; f++) {
+            memcpy(dst + (size_t) f * img1->cols, dst,
+                   img1->cols * sizeof(Pixel));
+        }
+    }
+    free(first);
+
+    return write_ppm(new_image, img1);
+}
+
+
+
+int zoom(Image * img1, FILE * new_image, int factor) {
+
+    // Checks that the zoom factor is valid, and that the zoomed
+    // dimensions still fit in an int
+    if (factor < 1 || img1->rows > INT_MAX / factor ||
+        img1->cols > INT_MAX / factor) {
+        return -1;
+    }
+
+    // Picks the unrolled row expander for common factors
+    void (*expand)(const Pixel *, Pixel *, int, int) = zoom_row_generic;
+    if (specialized_kernels) {
+        switch (factor) {
+        case 2: expand = zoom_row_2; break;
+        case 3: expand = zoom_row_3; break;
+        case 4: expand = zoom_row_4; break;
+        }
+    }
+
+    if (in_place) {
+        return zoom_in_place(img1, new_image, factor, expand);
+    }
 
     // Gets dimensions and space for new image
-    img2->rows = 2 * img1->rows;
-    img2->cols = 2 * img1->cols;
-    img2->data = malloc(img2->rows * img2->cols * sizeof(int));
+    Image * img2 = make_image(factor * img1->rows, factor * img1->cols);
+    if (!img2) {
+        return 0;
+    }
 
-    // Maps each coordinate pair to new locations in enlarged image
-    // For example, Coordinate i, j maps to the points (2i, 2j), (2i + 1, 2j),
-    // (2i, 2j + 1), (2i + 1, 2j + 1).
+    // Pixel (i, j) maps to the factor x factor block starting at
+    // (factor*i, factor*j): expand each source row once, then copy the
+    // expanded row down into the remaining rows of the block
     for (int i = 0; i < img1->rows; i++) {
-        for (int j = 0; j < img1->cols; j++) {
-            int k = i*img1->cols + j;
-
-            int k1 = (2*i)*img2->cols + (2 * j);
-            int k2 = k1 + img2->cols;
+        Pixel *dst = IMAGE_ROW(img2, factor * i);
+        expand(IMAGE_ROW(img1, i), dst, img1->cols, factor);
 
-	    // Modify data: create block of pixels in correct location
-            img2->data[k1] = img1->data[k];
-            img2->data[k1 + 1] = img1->data[k];
-            img2->data[k2] = img1->data[k];
-            img2->data[k2 + 1] = img1->data[k];
+        for (int f = 1; f < factor; f++) {
+            memcpy(dst + (size_t) f * img2->cols, dst,
+                   img2->cols * sizeof(Pixel));
         }
     }
 
@@ -135,20 +501,127 @@ int zoom_in(Image * img1, FILE * new_image) {
 
 
 
+int zoom_in(Image * img1, FILE * new_image) {
+    return zoom(img1, new_image, 2);
+}
+
+
+
+/* HELPER for rotate_left:
+ * rotate a square image in place: transpose it a tile at a time (so both
+ * tiles of each swapped pair stay in cache), then reverse the row order
+ */
+static void rotate_square_in_place(Image *img1) {
+    int n = img1->rows;
+    Pixel *data = img1->data;
+    const int tile = 32;
+
+    for (int bi = 0; bi < n; bi += tile) {
+        for (int bj = bi; bj < n; bj += tile) {
+            for (int i = bi; i < MIN(bi + tile, n); i++) {
+                for (int j = MAX(bj, i + 1); j < MIN(bj + tile, n); j++) {
+                    Pixel p = data[(size_t) i * n + j];
+                    data[(size_t) i * n + j] = data[(size_t) j * n + i];
+                    data[(size_t) j * n + i] = p;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < n / 2; i++) {
+        Pixel *top = IMAGE_ROW(img1, i);
+        Pixel *bottom = IMAGE_ROW(img1, n - 1 - i);
+        for (int j = 0; j < n; j++) {
+            Pixel p = top[j];
+            top[j] = bottom[j];
+            bottom[j] = p;
+        }
+    }
+}
+
+
+/* HELPER for rotate_left:
+ * rotate any image in place by following each cycle of the permutation
+ * that maps old positions to new ones; a bitmap (one bit per pixel)
+ * records which positions are already done
+ */
+static int rotate_cycles_in_place(Image *img1) {
+    size_t rows = img1->rows;
+    size_t cols = img1->cols;
+    size_t count = rows * cols;
+
+    unsigned char *done = calloc(count / 8 + 1, 1);
+    if (!done) {
+        return -1;
+    }
+
+    for (size_t start = 0; start < count; start++) {
+        if (done[start / 8] & (1 << (start % 8))) {
+            continue;
+        }
+
+        // Carries the pixel from each position to its destination,
+        // picking up the one that was there, until back at the start
+        Pixel carried = img1->data[start];
+        size_t k = start;
+        do {
+            size_t i = k / cols;
+            size_t j = k % cols;
+            size_t dest = (cols - 1 - j) * rows + i;
+
+            Pixel p = img1->data[dest];
+            img1->data[dest] = carried;
+            carried = p;
+            done[dest / 8] |= 1 << (dest % 8);
+            k = dest;
+        } while (k != start);
+    }
+
+    free(done);
+    return 0;
+}
+
+
+
+/* HELPER for rotate_left and rotate:
+ * rotate the image 90 degrees left in place, swapping its dimensions;
+ * returns -1 if out of memory
+ */
+static int rotate_left_in_place(Image *img1) {
+    if (img1->rows == img1->cols) {
+        rotate_square_in_place(img1);
+    } else if (rotate_cycles_in_place(img1) != 0) {
+        return -1;
+    }
+
+    int rows = img1->rows;
+    img1->rows = img1->cols;
+    img1->cols = rows;
+    return 0;
+}
+
+
+
 int rotate_left(Image * img1, FILE * new_image) {
-    Image * img2 = malloc(sizeof(Image));
+    if (in_place) {
+        if (rotate_left_in_place(img1) != 0) {
+            return 0;
+        }
+        return write_ppm(new_image, img1);
+    }
 
     // New image will have reverse dimension of the original
-    img2->rows = img1->cols;
-    img2->cols = img1->rows;
-    img2->data = malloc(img2->rows * img2->cols * sizeof(int));
+    Image * img2 = make_image(img1->cols, img1->rows);
+    if (!img2) {
+        return 0;
+    }
 
     // Pixel at (i, j) maps to (c - j - 1, i) in new image, where c is the
     // number of columns in the original image
     for (int i = 0; i < img1->rows; i++) {
         for (int j = 0; j < img1->cols; j++) {
-            int k1 = i*img1->cols + j;
-            int k2 = (img1->cols - 1 - j)*img2->cols + i;
+            size_t k1 = (size_t) i*img1->cols + j;
+            size_t k2 = (size_t) (img1->cols - 1 - j)*img2->cols + i;
 
             img2->data[k2] = img1->data[k1];
         }
@@ -162,19 +635,270 @@ int rotate_left(Image * img1, FILE * new_image) {
 }
 
 
-int pointillism(Image * img1, FILE * new_image) {
-    Image * img2 = malloc(sizeof(Image));
+/* HELPER for rotate:
+ * rotate by 180 or 270 degrees (quarters 2 or 3), which, like
+ * rotate_left, only moves pixels around; 180 degrees just reverses their
+ * order, and in place 270 degrees is a quarter turn left then a half turn
+ */
+static int rotate_quarters(Image *img1, FILE *new_image, int quarters) {
+    size_t count = image_bytes(img1->rows, img1->cols) / sizeof(Pixel);
+
+    if (quarters == 3 && in_place) {
+        if (rotate_left_in_place(img1) != 0) {
+            return 0;
+        }
+        quarters = 2;
+    }
 
-    // Setting up space for new image
-    img2->rows = img1->rows;
-    img2->cols = img1->cols;
-    img2->data = malloc(img2->rows * img2->cols * sizeof(int));
+    if (quarters == 2) {
+        Image *img2 = in_place ? img1 : make_copy(img1);
+        if (!img2) {
+            return 0;
+        }
+        for (size_t k = 0; k < count / 2; k++) {
+            Pixel p = img2->data[k];
+            img2->data[k] = img2->data[count - 1 - k];
+            img2->data[count - 1 - k] = p;
+        }
+        int result = write_ppm(new_image, img2);
+        if (img2 != img1) {
+            free_image(&img2);
+        }
+        return result;
+    }
 
-    // Loops through image for first time, and copies all contents to second image
-    for (int i = 0; i < img1->rows; i++) {
-        for (int j = 0; j < img1->cols; j++) {
-            int k = i*img1->cols + j;
-            img2->data[k] = img1->data[k];
+    // Pixel at (i, j) maps to (j, r - i - 1), where r is the number of
+    // rows in the original image; worked through in tiles so both images
+    // are read and written a cache line at a time
+    Image *img2 = make_image(img1->cols, img1->rows);
+    if (!img2) {
+        return 0;
+    }
+    const int tile = 32;
+    for (int bi = 0; bi < img1->rows; bi += tile) {
+        for (int bj = 0; bj < img1->cols; bj += tile) {
+            for (int i = bi; i < MIN(bi + tile, img1->rows); i++) {
+                const Pixel *row = IMAGE_ROW(img1, i);
+                for (int j = bj; j < MIN(bj + tile, img1->cols); j++) {
+                    IMAGE_ROW(img2, j)[img1->rows - 1 - i] = row[j];
+                }
+            }
+        }
+    }
+
+    int result = write_ppm(new_image, img2);
+    free_image(&img2);
+    return result;
+}
+
+
+
+/* Affine resampling engine.
+ *
+ * Every output pixel is looked up at the position the inverse transform
+ * takes it to in the input. The output is worked through in square tiles
+ * of AFFINE_TILE pixels, spread across threads; within a tile row the
+ * source position is computed once and then stepped along by a constant
+ * offset per pixel, so the inner loop is additions and the sampling
+ * itself. Pixel centers are at integer coordinates; positions within half
+ * a pixel of the image are sampled (with edge pixels repeated as needed
+ * for bilinear interpolation), and everything else is black.
+ */
+
+// Output pixels per side of a tile
+#define AFFINE_TILE 64
+
+
+/* struct to store the shared state of a (multithreaded) affine warp */
+typedef struct _affine_job {
+    const Image *img;
+    Image *out;
+    double inv[6];          // output -> input: x = inv[0] x' + inv[1] y'
+                            // + inv[2], y = inv[3] x' + inv[4] y' + inv[5]
+    Interpolation interp;
+    int tiles_across;
+} AffineJob;
+
+
+// Samples the input at (x, y), which is within half a pixel of it
+static Pixel affine_sample(const Image *img, double x, double y,
+                           Interpolation interp) {
+    if (interp == INTERP_NEAREST) {
+        return IMAGE_ROW(img, (int) (y + 0.5))[(int) (x + 0.5)];
+    }
+
+    // x and y are above -1, so this rounds down
+    int x0 = (int) (x + 1) - 1;
+    int y0 = (int) (y + 1) - 1;
+    double fx = x - x0;
+    double fy = y - y0;
+    const Pixel *top = IMAGE_ROW(img, MAX(y0, 0));
+    const Pixel *bottom = IMAGE_ROW(img, MIN(y0 + 1, img->rows - 1));
+    int xa = MAX(x0, 0);
+    int xb = MIN(x0 + 1, img->cols - 1);
+
+    double w00 = (1 - fx) * (1 - fy);
+    double w01 = fx * (1 - fy);
+    double w10 = (1 - fx) * fy;
+    double w11 = fx * fy;
+
+    Pixel p;
+    p.r = w00 * top[xa].r + w01 * top[xb].r + w10 * bottom[xa].r
+        + w11 * bottom[xb].r + 0.5;
+    p.g = w00 * top[xa].g + w01 * top[xb].g + w10 * bottom[xa].g
+        + w11 * bottom[xb].g + 0.5;
+    p.b = w00 * top[xa].b + w01 * top[xb].b + w10 * bottom[xa].b
+        + w11 * bottom[xb].b + 0.5;
+    return p;
+}
+
+
+// Fills tiles begin <= t < end of the output
+static void affine_tiles(void *ctx, int begin, int end, int thread) {
+    AffineJob *job = ctx;
+    (void) thread;
+    const Image *img = job->img;
+    const double *inv = job->inv;
+    double max_x = img->cols - 0.5;
+    double max_y = img->rows - 0.5;
+    Pixel black = { 0, 0, 0 };
+
+    for (int t = begin; t < end; t++) {
+        int i0 = t / job->tiles_across * AFFINE_TILE;
+        int j0 = t % job->tiles_across * AFFINE_TILE;
+        int i1 = MIN(i0 + AFFINE_TILE, job->out->rows);
+        int j1 = MIN(j0 + AFFINE_TILE, job->out->cols);
+
+        for (int i = i0; i < i1; i++) {
+            Pixel *out = IMAGE_ROW(job->out, i);
+
+            // Source position of (j0, i), then stepped one pixel at a time
+            double x = inv[0] * j0 + inv[1] * i + inv[2];
+            double y = inv[3] * j0 + inv[4] * i + inv[5];
+            for (int j = j0; j < j1; j++, x += inv[0], y += inv[3]) {
+                if (x >= -0.5 && x < max_x && y >= -0.5 && y < max_y) {
+                    out[j] = affine_sample(img, x, y, job->interp);
+                } else {
+                    out[j] = black;
+                }
+            }
+        }
+    }
+}
+
+
+/* HELPER for affine and rotate:
+ * warp the image by the transform m (input -> output), keeping its size
+ */
+static int affine_warp(Image *img1, FILE *new_image, const double m[6],
+                       Interpolation interp) {
+
+    // The transform has to be invertible
+    double det = m[0] * m[4] - m[1] * m[3];
+    if (!isfinite(det) || fabs(det) < 1e-12) {
+        return -1;
+    }
+
+    AffineJob job;
+    job.img = img1;
+    job.interp = interp;
+    job.inv[0] = m[4] / det;
+    job.inv[1] = -m[1] / det;
+    job.inv[2] = (m[1] * m[5] - m[4] * m[2]) / det;
+    job.inv[3] = -m[3] / det;
+    job.inv[4] = m[0] / det;
+    job.inv[5] = (m[3] * m[2] - m[0] * m[5]) / det;
+    for (int k = 0; k < 6; k++) {
+        if (!isfinite(job.inv[k])) {
+            return -1;
+        }
+    }
+
+    long long tiles_down = (img1->rows + AFFINE_TILE - 1) / AFFINE_TILE;
+    job.tiles_across = (img1->cols + AFFINE_TILE - 1) / AFFINE_TILE;
+    if (tiles_down * job.tiles_across > INT_MAX) {
+        return 0;
+    }
+
+    job.out = make_image(img1->rows, img1->cols);
+    if (!job.out) {
+        return 0;
+    }
+    parallel_for((int) (tiles_down * job.tiles_across), affine_tiles, &job);
+
+    int result = write_ppm(new_image, job.out);
+    free_image(&job.out);
+
+    return result;
+}
+
+
+
+int affine(Image * img1, FILE * new_image, const double m[6],
+           Interpolation interp) {
+    for (int k = 0; k < 6; k++) {
+        if (!isfinite(m[k])) {
+            return -1;
+        }
+    }
+    return affine_warp(img1, new_image, m, interp);
+}
+
+
+
+int rotate(Image * img1, FILE * new_image, float degrees,
+           Interpolation interp) {
+
+    // Checks that the angle is valid
+    if (!isfinite(degrees)) {
+        return -1;
+    }
+
+    // Quarter turns only move pixels, so take the lossless paths
+    if (fmod(degrees, 90) == 0) {
+        int quarters = (int) fmod(fmod(degrees / 90, 4) + 4, 4);
+        switch (quarters) {
+        case 0: return write_ppm(new_image, img1);
+        case 1: return rotate_left(img1, new_image);
+        default: return rotate_quarters(img1, new_image, quarters);
+        }
+    }
+
+    // Counter-clockwise about the center; rows count downwards, so the
+    // sine terms have the opposite signs to the usual rotation matrix
+    double theta = degrees * PI / 180;
+    double c = cos(theta);
+    double s = sin(theta);
+    double cx = (img1->cols - 1) / 2.0;
+    double cy = (img1->rows - 1) / 2.0;
+    double m[6] = { c, s, cx - c * cx - s * cy,
+                    -s, c, cy + s * cx - c * cy };
+
+    return affine_warp(img1, new_image, m, interp);
+}
+
+
+
+int pointillism(Image * img1, FILE * new_image) {
+    Image * img2;
+
+    // The effect only ever reads from the image it's painting on, so in
+    // place it can paint straight onto the original
+    if (in_place) {
+        img2 = img1;
+    } else {
+        // Setting up space for new image
+        img2 = make_image(img1->rows, img1->cols);
+        if (!img2) {
+            return 0;
+        }
+
+        // Loops through image for first time, and copies all contents to second image
+        for (int i = 0; i < img1->rows; i++) {
+            for (int j = 0; j < img1->cols; j++) {
+                size_t k = (size_t) i*img1->cols + j;
+                img2->data[k] = img1->data[k];
+            }
         }
     }
 
@@ -182,7 +906,7 @@ int pointillism(Image * img1, FILE * new_image) {
     // pixels.
     for (int i = 0; i < img1->rows; i++) {
         for (int j = 0; j < img1->cols; j++) {
-            int k1 = i*img1->cols + j;
+            size_t k1 = (size_t) i*img1->cols + j;
             int pointillism_val = rand() % 100 + 1;
 
 	        // Applies effect only to random group of pixels
@@ -201,7 +925,7 @@ int pointillism(Image * img1, FILE * new_image) {
                             if ((m - i)*(m - i) + (n - j)*(n - j) <=
                                 radius*radius) {
 
-                                int k2 = m*img1->cols + n;
+                                size_t k2 = (size_t) m*img1->cols + n;
                                 img2->data[k2] = img2->data[k1];
                             }
                         }
@@ -214,86 +938,2198 @@ int pointillism(Image * img1, FILE * new_image) {
 
     // Writes new image
     int result = write_ppm(new_image, img2);
-    free_image(&img2);
+    if (img2 != img1) {
+        free_image(&img2);
+    }
 
     return result;
 }
 
 
 
-int blur(Image * img1, FILE * new_image, float sigma) {
+/* HELPER for blur:
+ * blur a single pixel, skipping (and renormalizing for) any part of the
+ * n x n gaussian window that falls outside the image; input row y is read
+ * through rowp[y - first], so rows needn't be in the image itself
+ */
+static Pixel blur_pixel(const Pixel * const *rowp, int first, int row_count,
+                        int col_count, const double *gaussian, int n,
+                        int i, int j) {
+    int gaussian_center = n/2;
 
-    // Modify sigma so it's ready for use
-    int n = 10*sigma;
-    if (n%2 == 0) {
-        n++;
+    double sum = 0;
+    double avg_r = 0;
+    double avg_g = 0;
+    double avg_b = 0;
+
+    // Iterates through gaussian matrix
+    for (int m = 0; m < n; m++) {
+        for (int l = 0; l < n; l++) {
+            int curr_row = i - gaussian_center + m;
+            int curr_col = j - gaussian_center + l;
+
+            // Checks if values are in range of img
+            if (curr_row >= 0 && curr_row < row_count &&  curr_col >= 0
+                && curr_col < col_count) {
+
+                // Gets gaussian value and multiply rgb value by it
+                sum += gaussian[m*n + l];
+                const Pixel *p = &rowp[curr_row - first][curr_col];
+                avg_r += p->r*gaussian[m*n+l];
+                avg_g += p->g*gaussian[m*n+l];
+                avg_b += p->b*gaussian[m*n+l];
+           }
+        }
     }
 
-    double* gaussian = (double*) malloc(sizeof(double) * n * n);
-    int gaussian_center = n/2;
-    
-    // Set up gaussian matrix
-    for (int i = 0; i < n; i++) {
-        for (int j = 0; j < n; j++) {
-            int dx = abs(gaussian_center - i);
-            int dy = abs(gaussian_center - j);
-            gaussian[(int)(i * n + j)] = (1.0 / (2.0 * PI * sq(sigma)))
-                    * exp( -(sq(dx) + sq(dy)) / (2 * sq(sigma)));
-        }
-    }
-
-    Image *img2 = make_copy(img1);
-    int row_count = img1->rows;
-    int col_count = img1->cols;
-
-    // Loops over input image
-    for (int i = 0; i < row_count; i++) {
-        for (int j = 0; j < col_count; j++) {
-            double sum = 0;
-            double avg_r = 0;
-            double avg_g = 0;
-            double avg_b = 0;
-
-            // Iterates through gaussian matrix
-            for (int m = 0; m < n; m++) {
-                for (int l = 0; l < n; l++) {
-                    int curr_row = i - gaussian_center + m;
-                    int curr_col = j - gaussian_center + l;
-
-                    // Checks if values are in range of img
-                    if (curr_row >= 0 && curr_row < row_count &&  curr_col >= 0
-                        && curr_col < col_count) {
-
-                        // Gets gaussian value and multiply rgb value by it
-                        sum += gaussian[m*n + l];
-                        avg_r += img1->data[curr_row*col_count+ curr_col].r*
-                                            gaussian[m*n+l];
-                        avg_g += img1->data[curr_row*col_count+ curr_col].g*
-                                            gaussian[m*n+l];
-                        avg_b += img1->data[curr_row*col_count+ curr_col].b*
-                                            gaussian[m*n+l];
-                   }
-                }
-            }
+    // Normalizes values
+    Pixel p;
+    p.r = avg_r/sum;
+    p.g = avg_g/sum;
+    p.b = avg_b/sum;
+
+    return p;
+}
+
 
-	        // Normalizes values
-            Pixel p;
-            p.r = avg_r/sum;
-            p.g = avg_g/sum;
-            p.b = avg_b/sum;
+/* Interior row kernels for blur: pixels j0 <= j < j1 of row i, whose whole
+ * N x N window lies inside the image, so no bounds checks are needed and the
+ * normalizing sum is the precomputed total. Four neighbouring output pixels
+ * are accumulated side by side, which gives the CPU (and the vectorizer)
+ * twelve independent sums to work on instead of three; each sum still adds
+ * its taps in the same order as blur_pixel, so the output is identical.
+ * BLUR_ROW(name, N) stamps out a copy with the window width fixed at compile
+ * time so the tap loops can be fully unrolled; the generic version passes
+ * the runtime width through as N.
+ */
+#define BLUR_ROW(NAME, N)                                                   \
+static void NAME(const Pixel * const *rowp, int first, Pixel *out,         \
+                 const double *gaussian, int n, double total, int i,       \
+                 int j0, int j1) {                                          \
+    (void) n;                                                               \
+    const Pixel * const *top = rowp + (i - first) - (N)/2;                  \
+    int j = j0;                                                             \
+    for (; j + 4 <= j1; j += 4) {                                           \
+        double avg_r[4] = { 0, 0, 0, 0 };                                   \
+        double avg_g[4] = { 0, 0, 0, 0 };                                   \
+        double avg_b[4] = { 0, 0, 0, 0 };                                   \
+        for (int m = 0; m < (N); m++) {                                     \
+            const Pixel *row = top[m] + j - (N)/2;                          \
+            for (int l = 0; l < (N); l++) {                                 \
+                double w = gaussian[m*(N) + l];                             \
+                for (int q = 0; q < 4; q++) {                               \
+                    avg_r[q] += row[l + q].r * w;                           \
+                    avg_g[q] += row[l + q].g * w;                           \
+                    avg_b[q] += row[l + q].b * w;                           \
+                }                                                           \
+            }                                                               \
+        }                                                                   \
+        for (int q = 0; q < 4; q++) {                                       \
+            out[j + q].r = avg_r[q]/total;                                  \
+            out[j + q].g = avg_g[q]/total;                                  \
+            out[j + q].b = avg_b[q]/total;                                  \
+        }                                                                   \
+    }                                                                       \
+    for (; j < j1; j++) {                                                   \
+        double avg_r = 0;                                                   \
+        double avg_g = 0;                                                   \
+        double avg_b = 0;                                                   \
+        for (int m = 0; m < (N); m++) {                                     \
+            const Pixel *row = top[m] + j - (N)/2;                          \
+            for (int l = 0; l < (N); l++) {                                 \
+                double w = gaussian[m*(N) + l];                             \
+                avg_r += row[l].r * w;                                      \
+                avg_g += row[l].g * w;                                      \
+                avg_b += row[l].b * w;                                      \
+            }                                                               \
+        }                                                                   \
+        out[j].r = avg_r/total;                                             \
+        out[j].g = avg_g/total;                                             \
+        out[j].b = avg_b/total;                                             \
+    }                                                                       \
+}
 
-	        // Sets data
-            img2->data[i * col_count + j] = p;
+BLUR_ROW(blur_row_3, 3)
+BLUR_ROW(blur_row_5, 5)
+BLUR_ROW(blur_row_7, 7)
+BLUR_ROW(blur_row_11, 11)
+BLUR_ROW(blur_row_15, 15)
+BLUR_ROW(blur_row_generic, n)
+
+
+
+/* struct to store the shared state of a (multithreaded) blur */
+typedef struct _blur_job {
+    const Pixel **rowp;     // input rows, by row number less first
+    int first;
+    int rows;
+    int cols;
+    Pixel *out;             // output image
+    const double *gaussian;
+    int n;
+    double total;
+    void (*interior)(const Pixel * const *, int, Pixel *, const double *,
+                     int, double, int, int, int);
+} BlurJob;
+
+/* struct to store the state of an in-place blur, done in bands of rows */
+typedef struct _blur_band_job {
+    const BlurJob *job;
+    Image *img;
+    int bands;
+    int slots;              // rows in each band's ring
+    int halo;               // rows saved on each side of a band: r, or 0
+                            // if there's only one band
+    Pixel *saved;           // per band: its ring, then copies of the halo
+                            // rows above it and the halo rows below it
+    int window;             // rows each band reads: its own and the halos
+    const Pixel **rowp;     // per band: the window's rows
+} BlurBandJob;
+
+
+// Blurs columns begin <= j < end of row i into out
+static void blur_span(const BlurJob *job, Pixel *out, int i, int begin,
+                     int end) {
+    int n = job->n;
+    int gaussian_center = n/2;
 
+    // Rows near the top/bottom edge need bounds checks everywhere, as
+    // does every row when the specialized kernels are switched off
+    if (!specialized_kernels || i < gaussian_center ||
+        i >= job->rows - gaussian_center) {
+        for (int j = begin; j < end; j++) {
+            out[j] = blur_pixel(job->rowp, job->first, job->rows, job->cols,
+                                job->gaussian, n, i, j);
         }
+        return;
     }
 
-    // Writes blurred image
-    int result = write_ppm(new_image, img2);
-    free(gaussian);
-    free_image(&img2);
+    // Columns whose window lies fully inside the image
+    int j0 = MAX(gaussian_center, begin);
+    int j1 = MIN(job->cols - gaussian_center, end);
+    j1 = MAX(j1, j0);
 
-    return result;
+    for (int j = begin; j < MIN(j0, end); j++) {
+        out[j] = blur_pixel(job->rowp, job->first, job->rows, job->cols,
+                            job->gaussian, n, i, j);
+    }
+    job->interior(job->rowp, job->first, out, job->gaussian, n, job->total,
+                  i, j0, j1);
+    for (int j = MAX(j1, begin); j < end; j++) {
+        out[j] = blur_pixel(job->rowp, job->first, job->rows, job->cols,
+                            job->gaussian, n, i, j);
+    }
+}
 
 
+// Blurs rows begin <= i < end of a BlurJob; rows are independent, so
+// parallel_for can hand each thread its own band
+static void blur_rows(void *ctx, int begin, int end, int thread) {
+    BlurJob *job = ctx;
+    (void) thread;
+
+    for (int i = begin; i < end; i++) {
+        blur_span(job, job->out + (size_t) i * job->cols, i, 0, job->cols);
+    }
+}
+
+
+/* HELPER for blur_in_place:
+ * blurs bands begin <= b < end in place. Each band keeps copies of only
+ * the n input rows the current output row depends on; rows above it in
+ * the band have already been overwritten and rows below it are still
+ * untouched. Rows next to the band belong to other bands, which may be
+ * overwriting them, so they're read from the copies saved beforehand.
+ */
+static void blur_bands(void *ctx, int begin, int end, int thread) {
+    BlurBandJob *bj = ctx;
+    Image *img = bj->img;
+    int r = bj->job->n/2;
+    int slots = bj->slots;
+    int h = bj->halo;
+    size_t row_bytes = img->cols * sizeof(Pixel);
+    (void) thread;
+
+    for (int b = begin; b < end; b++) {
+        int b0 = (int) ((long long) img->rows * b / bj->bands);
+        int b1 = (int) ((long long) img->rows * (b + 1) / bj->bands);
+        Pixel *ring = bj->saved + (size_t) b * (slots + 2 * h) * img->cols;
+        Pixel *halo = ring + (size_t) slots * img->cols;
+
+        // Each band has its own row pointers, covering rows b0 - r up to
+        // b1 + r, since the same row is held in different places by
+        // neighbouring bands
+        BlurJob job = *bj->job;
+        job.rowp = bj->rowp + (size_t) b * bj->window;
+        job.first = b0 - r;
+        for (int k = 0; k < h; k++) {
+            if (b0 - h + k >= 0) {
+                job.rowp[k] = halo + (size_t) k * img->cols;
+            }
+            if (b1 + k < img->rows) {
+                job.rowp[b1 + k - job.first] = halo + (size_t) (h + k) * img->cols;
+            }
+        }
+
+        // Row y of the band is kept in slot y % slots of the ring; rows
+        // b0..b0 + r are needed for the first output row
+        for (int y = b0; y <= b0 + r && y < b1; y++) {
+            memcpy(ring + (size_t) (y % slots) * img->cols, IMAGE_ROW(img, y),
+                   row_bytes);
+            job.rowp[y - job.first] = ring + (size_t) (y % slots) * img->cols;
+        }
+
+        for (int i = b0; i < b1; i++) {
+            // Brings row i + r into the ring, over row i - r - 1
+            int y = i + r;
+            if (i > b0 && y < b1) {
+                memcpy(ring + (size_t) (y % slots) * img->cols,
+                       IMAGE_ROW(img, y), row_bytes);
+                job.rowp[y - job.first] = ring + (size_t) (y % slots) * img->cols;
+            }
+
+            blur_span(&job, IMAGE_ROW(img, i), i, 0, img->cols);
+        }
+    }
+}
+
+
+/* HELPER for blur:
+ * blur the image in place, in bands of rows spread across threads. Each
+ * band needs a ring of n rows plus 2r halo rows, so there are only as
+ * many bands as keep all that to an eighth of the image; small images
+ * are done as one band, which needs no halo
+ */
+static int blur_in_place(Image *img1, const BlurJob *job) {
+    int r = job->n/2;
+    size_t row_bytes = img1->cols * sizeof(Pixel);
+
+    BlurBandJob bj;
+    bj.job = job;
+    bj.img = img1;
+    bj.slots = MIN(job->n, img1->rows);
+    bj.bands = MIN(parallel_threads(), img1->rows / (8 * (bj.slots + 2 * r)));
+    bj.bands = MAX(bj.bands, 1);
+    bj.halo = bj.bands > 1 ? r : 0;
+    bj.window = (img1->rows + bj.bands - 1) / bj.bands + 2 * r;
+    bj.saved = malloc(row_bytes * (bj.slots + 2 * bj.halo) * bj.bands);
+    bj.rowp = malloc(sizeof(Pixel *) * bj.window * bj.bands);
+    if (!bj.saved || !bj.rowp) {
+        free(bj.saved);
+        free(bj.rowp);
+        return -1;
+    }
+
+    // Saves the rows on either side of each band before any are blurred
+    for (int b = 0; b < bj.bands && bj.halo > 0; b++) {
+        int b0 = (int) ((long long) img1->rows * b / bj.bands);
+        int b1 = (int) ((long long) img1->rows * (b + 1) / bj.bands);
+        Pixel *halo = bj.saved +
+                      ((size_t) b * (bj.slots + 2 * r) + bj.slots) * img1->cols;
+        for (int k = 0; k < r; k++) {
+            if (b0 - r + k >= 0) {
+                memcpy(halo + (size_t) k * img1->cols,
+                       IMAGE_ROW(img1, b0 - r + k), row_bytes);
+            }
+            if (b1 + k < img1->rows) {
+                memcpy(halo + (size_t) (r + k) * img1->cols,
+                       IMAGE_ROW(img1, b1 + k), row_bytes);
+            }
+        }
+    }
+
+    parallel_for(bj.bands, blur_bands, &bj);
+
+    free(bj.saved);
+    free(bj.rowp);
+    return 0;
+}
+
+
+
+int blur(Image * img1, FILE * new_image, float sigma) {
+
+    // Checks that sigma gives a usable kernel
+    if (kernel_width(sigma, KERNEL_EXACT) < 0) {
+        return -1;
+    }
+
+    // Gaussian table for this sigma, shared with earlier/concurrent calls
+    const Kernel *kernel = kernel_acquire(sigma, KERNEL_EXACT);
+    if (!kernel) {
+        return 0;
+    }
+
+    BlurJob job;
+    job.rows = img1->rows;
+    job.cols = img1->cols;
+    job.gaussian = kernel->weights2d;
+    job.n = kernel->n;
+    job.total = kernel->total;
+
+    // Picks the unrolled interior kernel for common window widths
+    job.interior = blur_row_generic;
+    if (specialized_kernels) {
+        switch (job.n) {
+        case 3: job.interior = blur_row_3; break;
+        case 5: job.interior = blur_row_5; break;
+        case 7: job.interior = blur_row_7; break;
+        case 11: job.interior = blur_row_11; break;
+        case 15: job.interior = blur_row_15; break;
+        }
+    }
+
+    int result;
+    if (in_place) {
+        result = blur_in_place(img1, &job) == 0 ?
+                 write_ppm(new_image, img1) : 0;
+    } else {
+        // Every output pixel gets written, so no need to copy the input
+        Image *img2 = make_image(img1->rows, img1->cols);
+        job.rowp = malloc(sizeof(Pixel *) * img1->rows);
+        job.first = 0;
+        if (img2 && job.rowp) {
+            for (int i = 0; i < img1->rows; i++) {
+                job.rowp[i] = IMAGE_ROW(img1, i);
+            }
+            job.out = img2->data;
+
+            // Blurs bands of rows in parallel
+            parallel_for(img1->rows, blur_rows, &job);
+
+            // Writes blurred image
+            result = write_ppm(new_image, img2);
+        } else {
+            result = 0;
+        }
+        free_image(&img2);
+        free(job.rowp);
+    }
+
+    kernel_release(kernel);
+
+    return result;
+}
+
+
+
+/* Convolution engine.
+ *
+ * The input is first expanded into a float buffer, three interleaved
+ * channels per pixel, padded by the kernel radius on every side according
+ * to the border mode. Every pass is then built from one primitive: add a
+ * weighted, shifted input row segment to an accumulator row segment. Rows
+ * are split across threads, and each row is worked through in tiles of
+ * CONV_TILE pixels so the accumulator and the input rows it reads stay in
+ * cache while all the taps are applied.
+ *
+ * Kernels that are the outer product of a column and a row vector (rank 1)
+ * are run as a horizontal pass followed by a vertical pass, costing
+ * width + height multiply-adds per pixel instead of width * height.
+ */
+
+// Pixels per cache tile
+#define CONV_TILE 256
+
+// Relative tolerance when testing a kernel for separability
+#define SEPARABLE_EPS 1e-6
+
+
+ConvKernel * make_conv_kernel(int width, int height) {
+    if (width <= 0 || height <= 0 || width % 2 == 0 || height % 2 == 0 ||
+            width > CONV_MAX_SIZE || height > CONV_MAX_SIZE) {
+        return NULL;
+    }
+
+    ConvKernel *k = malloc(sizeof(ConvKernel));
+    if (!k) {
+        return NULL;
+    }
+    k->width = width;
+    k->height = height;
+    k->weights = calloc((size_t) width * height, sizeof(double));
+    if (!k->weights) {
+        free(k);
+        return NULL;
+    }
+
+    return k;
+}
+
+
+
+void free_conv_kernel(ConvKernel **k) {
+    if (*k) {
+        free((*k)->weights);
+        free(*k);
+        *k = NULL;
+    }
+}
+
+
+
+ConvKernel * read_conv_kernel(FILE *fp) {
+    int width, height;
+    if (fscanf(fp, "%d %d", &width, &height) != 2) {
+        return NULL;
+    }
+
+    ConvKernel *k = make_conv_kernel(width, height);
+    if (!k) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < (size_t) width * height; i++) {
+        if (fscanf(fp, "%lf", &k->weights[i]) != 1) {
+            free_conv_kernel(&k);
+            return NULL;
+        }
+    }
+
+    return k;
+}
+
+
+
+/* HELPER for convolution:
+ * map a (possibly out of range) index onto [0, n) for the border mode;
+ * returns -1 if the pixel should be treated as zero
+ */
+static int border_index(int i, int n, BorderMode border) {
+    if (i >= 0 && i < n) {
+        return i;
+    }
+
+    switch (border) {
+    case BORDER_CLAMP:
+        return i < 0 ? 0 : n - 1;
+
+    case BORDER_MIRROR: {
+        // Reflects about the first and last pixels: -1 -> 1, n -> n - 2
+        if (n == 1) {
+            return 0;
+        }
+        int period = 2 * (n - 1);
+        i %= period;
+        if (i < 0) {
+            i += period;
+        }
+        return i < n ? i : period - i;
+    }
+
+    default:
+        return -1;
+    }
+}
+
+
+
+/* HELPER for convolution:
+ * try to factor k as column vector v times row vector h;
+ * returns 1 and fills v and h if k is separable
+ */
+static int separate_kernel(const ConvKernel *k, float *v, float *h) {
+    int kw = k->width;
+    int kh = k->height;
+    const double *w = k->weights;
+
+    // Uses the largest weight as the pivot
+    int pivot = 0;
+    for (int i = 1; i < kw * kh; i++) {
+        if (fabs(w[i]) > fabs(w[pivot])) {
+            pivot = i;
+        }
+    }
+    double scale = fabs(w[pivot]);
+    if (scale == 0) {
+        return 0;
+    }
+    int pr = pivot / kw;
+    int pc = pivot % kw;
+
+    // Column through the pivot, and the pivot's row scaled by the pivot
+    for (int m = 0; m < kh; m++) {
+        v[m] = w[m * kw + pc];
+    }
+    for (int l = 0; l < kw; l++) {
+        h[l] = w[pr * kw + l] / w[pivot];
+    }
+
+    for (int m = 0; m < kh; m++) {
+        for (int l = 0; l < kw; l++) {
+            double product = (double) v[m] * h[l];
+            if (fabs(product - w[m * kw + l]) > SEPARABLE_EPS * scale) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+
+
+/* struct to store the shared state of a convolution */
+typedef struct _conv_job {
+    const Image *img;
+    BorderMode border;
+    int rx, ry;             // kernel radius in x and y
+    int pcols;              // padded width in pixels
+    float *src;             // padded input, (rows + 2ry) x pcols x 3
+    float *tmp;             // horizontal pass output, (rows + 2ry) x cols x 3
+    float *dst;             // output, rows x cols x 3
+    const float *weights;   // 2D weights (non-separable kernels)
+    const float *v;         // vertical weights (separable kernels)
+    const float *h;         // horizontal weights (separable kernels)
+    const double *area;     // summed-area table of the kernel, for
+                            // BORDER_RENORMALIZE
+} ConvJob;
+
+
+// acc[x] += w * in[x] for x < len; the loop every pass is built from
+static void accumulate(float *acc, float w, const float *in, int len) {
+    for (int x = 0; x < len; x++) {
+        acc[x] += w * in[x];
+    }
+}
+
+
+// Fills padded rows begin <= p < end of the source buffer
+static void conv_pad_rows(void *ctx, int begin, int end, int thread) {
+    ConvJob *job = ctx;
+    const Image *img = job->img;
+    (void) thread;
+
+    for (int p = begin; p < end; p++) {
+        float *row = job->src + (size_t) p * job->pcols * 3;
+        int i = border_index(p - job->ry, img->rows, job->border);
+
+        for (int q = 0; q < job->pcols; q++) {
+            int j = border_index(q - job->rx, img->cols, job->border);
+            if (i < 0 || j < 0) {
+                row[3*q] = row[3*q + 1] = row[3*q + 2] = 0;
+            } else {
+                const Pixel *px = IMAGE_ROW(img, i) + j;
+                row[3*q] = px->r;
+                row[3*q + 1] = px->g;
+                row[3*q + 2] = px->b;
+            }
+        }
+    }
+}
+
+
+// Horizontal pass of a separable kernel over padded rows begin..end
+static void conv_horizontal_rows(void *ctx, int begin, int end, int thread) {
+    ConvJob *job = ctx;
+    int cols = job->img->cols;
+    int kw = 2 * job->rx + 1;
+    (void) thread;
+
+    for (int p = begin; p < end; p++) {
+        const float *in = job->src + (size_t) p * job->pcols * 3;
+        float *out = job->tmp + (size_t) p * cols * 3;
+
+        for (int j0 = 0; j0 < cols; j0 += CONV_TILE) {
+            int len = 3 * MIN(CONV_TILE, cols - j0);
+            float *acc = out + 3 * j0;
+            memset(acc, 0, len * sizeof(float));
+            for (int l = 0; l < kw; l++) {
+                accumulate(acc, job->h[l], in + 3 * (j0 + l), len);
+            }
+        }
+    }
+}
+
+
+// Vertical pass of a separable kernel over output rows begin..end
+static void conv_vertical_rows(void *ctx, int begin, int end, int thread) {
+    ConvJob *job = ctx;
+    int cols = job->img->cols;
+    int kh = 2 * job->ry + 1;
+    (void) thread;
+
+    for (int i = begin; i < end; i++) {
+        float *out = job->dst + (size_t) i * cols * 3;
+
+        for (int j0 = 0; j0 < cols; j0 += CONV_TILE) {
+            int len = 3 * MIN(CONV_TILE, cols - j0);
+            float *acc = out + 3 * j0;
+            memset(acc, 0, len * sizeof(float));
+            for (int m = 0; m < kh; m++) {
+                const float *in = job->tmp + ((size_t) (i + m) * cols + j0) * 3;
+                accumulate(acc, job->v[m], in, len);
+            }
+        }
+    }
+}
+
+
+// Full 2D pass of a non-separable kernel over output rows begin..end
+static void conv_2d_rows(void *ctx, int begin, int end, int thread) {
+    ConvJob *job = ctx;
+    int cols = job->img->cols;
+    int kw = 2 * job->rx + 1;
+    int kh = 2 * job->ry + 1;
+    (void) thread;
+
+    for (int i = begin; i < end; i++) {
+        float *out = job->dst + (size_t) i * cols * 3;
+
+        for (int j0 = 0; j0 < cols; j0 += CONV_TILE) {
+            int len = 3 * MIN(CONV_TILE, cols - j0);
+            float *acc = out + 3 * j0;
+            memset(acc, 0, len * sizeof(float));
+            for (int m = 0; m < kh; m++) {
+                const float *in = job->src +
+                                  ((size_t) (i + m) * job->pcols + j0) * 3;
+                for (int l = 0; l < kw; l++) {
+                    float w = job->weights[m * kw + l];
+                    if (w != 0) {
+                        accumulate(acc, w, in + 3 * l, len);
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+// Sum of kernel weights in rows m0..m1-1, columns l0..l1-1, read off the
+// summed-area table (which has a zero first row and column)
+static double kernel_area(const double *area, int kw, int m0, int m1,
+                          int l0, int l1) {
+    return area[m1 * (kw + 1) + l1] - area[m0 * (kw + 1) + l1]
+         - area[m1 * (kw + 1) + l0] + area[m0 * (kw + 1) + l0];
+}
+
+
+// Rescales output rows begin..end by the kernel weight that fell inside
+// the image (BORDER_RENORMALIZE); interior pixels keep the full weight
+static void conv_renormalize_rows(void *ctx, int begin, int end, int thread) {
+    ConvJob *job = ctx;
+    int rows = job->img->rows;
+    int cols = job->img->cols;
+    int kw = 2 * job->rx + 1;
+    int kh = 2 * job->ry + 1;
+    double full = kernel_area(job->area, kw, 0, kh, 0, kw);
+    (void) thread;
+
+    // A kernel whose weights cancel out (e.g. an edge detector) can't be
+    // renormalized, so it is left zero-padded
+    if (full == 0) {
+        return;
+    }
+
+    for (int i = begin; i < end; i++) {
+        int m0 = MAX(0, job->ry - i);
+        int m1 = MIN(kh, rows - i + job->ry);
+        int row_clipped = (m0 > 0 || m1 < kh);
+
+        for (int j = 0; j < cols; j++) {
+            int l0 = MAX(0, job->rx - j);
+            int l1 = MIN(kw, cols - j + job->rx);
+            if (!row_clipped && l0 == 0 && l1 == kw) {
+                // Jumps over the interior of the row
+                j = MAX(j, cols - job->rx - 1);
+                continue;
+            }
+
+            double inside = kernel_area(job->area, kw, m0, m1, l0, l1);
+            if (fabs(inside) > 1e-12 * fabs(full)) {
+                float scale = full / inside;
+                float *px = job->dst + ((size_t) i * cols + j) * 3;
+                px[0] *= scale;
+                px[1] *= scale;
+                px[2] *= scale;
+            }
+        }
+    }
+}
+
+
+
+float * convolve_channels(const Image *img, const ConvKernel *k,
+                          BorderMode border) {
+    int rows = img->rows;
+    int cols = img->cols;
+    int kw = k->width;
+    int kh = k->height;
+
+    ConvJob job;
+    memset(&job, 0, sizeof(job));
+    job.img = img;
+    job.border = border;
+    job.rx = kw / 2;
+    job.ry = kh / 2;
+    job.pcols = cols + 2 * job.rx;
+
+    size_t prows = (size_t) rows + 2 * job.ry;
+
+    // The float buffers take four times the bytes of the padded image
+    size_t padded = image_bytes(rows + 2 * job.ry, job.pcols);
+    if (padded == 0 || padded > PTRDIFF_MAX / sizeof(float)) {
+        return NULL;
+    }
+    float *v = malloc(sizeof(float) * kh);
+    float *h = malloc(sizeof(float) * kw);
+    float *weights = malloc(sizeof(float) * kw * kh);
+    double *area = calloc((size_t) (kw + 1) * (kh + 1), sizeof(double));
+    job.src = malloc(sizeof(float) * 3 * prows * job.pcols);
+    job.dst = malloc(sizeof(float) * 3 * (size_t) rows * cols);
+    if (!v || !h || !weights || !area || !job.src || !job.dst) {
+        goto fail;
+    }
+
+    // Pixels outside the image are zero while renormalizing
+    if (border == BORDER_RENORMALIZE) {
+        job.border = BORDER_ZERO;
+    }
+    parallel_for(prows, conv_pad_rows, &job);
+    job.border = border;
+
+    if (separate_kernel(k, v, h)) {
+        job.v = v;
+        job.h = h;
+        job.tmp = malloc(sizeof(float) * 3 * prows * cols);
+        if (!job.tmp) {
+            goto fail;
+        }
+        parallel_for(prows, conv_horizontal_rows, &job);
+        parallel_for(rows, conv_vertical_rows, &job);
+        free(job.tmp);
+    } else {
+        for (int i = 0; i < kw * kh; i++) {
+            weights[i] = k->weights[i];
+        }
+        job.weights = weights;
+        parallel_for(rows, conv_2d_rows, &job);
+    }
+
+    if (border == BORDER_RENORMALIZE) {
+        for (int m = 0; m < kh; m++) {
+            for (int l = 0; l < kw; l++) {
+                area[(m + 1) * (kw + 1) + l + 1] = k->weights[m * kw + l]
+                        + area[m * (kw + 1) + l + 1]
+                        + area[(m + 1) * (kw + 1) + l]
+                        - area[m * (kw + 1) + l];
+            }
+        }
+        job.area = area;
+        parallel_for(rows, conv_renormalize_rows, &job);
+    }
+
+    free(v);
+    free(h);
+    free(weights);
+    free(area);
+    free(job.src);
+    return job.dst;
+
+fail:
+    free(v);
+    free(h);
+    free(weights);
+    free(area);
+    free(job.src);
+    free(job.dst);
+    return NULL;
+}
+
+
+
+// Rounds a channel value to the nearest byte, saturating at 0 and 255
+static unsigned char clamp_channel(float value) {
+    if (value <= 0) {
+        return 0;
+    }
+    if (value >= 255) {
+        return 255;
+    }
+    return (unsigned char) (value + 0.5f);
+}
+
+
+
+/* HELPER for the convolution operations:
+ * write a rows x cols x 3 float buffer out as a PPM, saturating each
+ * channel; frees the buffer
+ */
+static int write_channels(FILE *new_image, float *channels, int rows,
+                          int cols) {
+    Image *img2 = make_image(rows, cols);
+    if (!img2) {
+        free(channels);
+        return 0;
+    }
+
+    size_t count = (size_t) rows * cols;
+    for (size_t k = 0; k < count; k++) {
+        img2->data[k].r = clamp_channel(channels[3*k]);
+        img2->data[k].g = clamp_channel(channels[3*k + 1]);
+        img2->data[k].b = clamp_channel(channels[3*k + 2]);
+    }
+    free(channels);
+
+    int result = write_ppm(new_image, img2);
+    free_image(&img2);
+
+    return result;
+}
+
+
+
+int convolve(Image * img1, FILE * new_image, const ConvKernel * k,
+             BorderMode border) {
+    float *channels = convolve_channels(img1, k, border);
+    if (!channels) {
+        return 0;
+    }
+
+    return write_channels(new_image, channels, img1->rows, img1->cols);
+}
+
+
+
+int sharpen(Image * img1, FILE * new_image) {
+    static double weights[] = {  0, -1,  0,
+                                -1,  5, -1,
+                                 0, -1,  0 };
+
+    ConvKernel k = { 3, 3, weights };
+    return convolve(img1, new_image, &k, BORDER_CLAMP);
+}
+
+
+
+int unsharp(Image * img1, FILE * new_image, float sigma, float amount) {
+
+    // Checks that the parameters are valid, and that the kernel for sigma
+    // fits in a ConvKernel
+    int width = kernel_width(sigma, KERNEL_FAST);
+    if (width < 0 || width > CONV_MAX_SIZE || !(amount >= 0)) {
+        return -1;
+    }
+
+    // Builds the (separable) gaussian from the cached 1D weights
+    const Kernel *gauss = kernel_acquire(sigma, KERNEL_FAST);
+    if (!gauss) {
+        return 0;
+    }
+    ConvKernel *k = make_conv_kernel(gauss->n, gauss->n);
+    if (!k) {
+        kernel_release(gauss);
+        return 0;
+    }
+    for (int m = 0; m < gauss->n; m++) {
+        for (int l = 0; l < gauss->n; l++) {
+            k->weights[m * gauss->n + l] = gauss->weights1d[m] *
+                                           gauss->weights1d[l];
+        }
+    }
+    kernel_release(gauss);
+
+    float *blurred = convolve_channels(img1, k, BORDER_RENORMALIZE);
+    free_conv_kernel(&k);
+    if (!blurred) {
+        return 0;
+    }
+
+    // Adds back amount times the detail the blur removed
+    const unsigned char *orig = (const unsigned char *) img1->data;
+    for (size_t x = 0; x < image_bytes(img1->rows, img1->cols); x++) {
+        blurred[x] = orig[x] + amount * (orig[x] - blurred[x]);
+    }
+
+    return write_channels(new_image, blurred, img1->rows, img1->cols);
+}
+
+
+
+int sobel(Image * img1, FILE * new_image) {
+    static double gx_weights[] = { -1, 0, 1,
+                                   -2, 0, 2,
+                                   -1, 0, 1 };
+    static double gy_weights[] = { -1, -2, -1,
+                                    0,  0,  0,
+                                    1,  2,  1 };
+
+    ConvKernel kx = { 3, 3, gx_weights };
+    ConvKernel ky = { 3, 3, gy_weights };
+
+    float *gx = convolve_channels(img1, &kx, BORDER_CLAMP);
+    float *gy = convolve_channels(img1, &ky, BORDER_CLAMP);
+    if (!gx || !gy) {
+        free(gx);
+        free(gy);
+        return 0;
+    }
+
+    // Gradient magnitude, per channel
+    for (size_t x = 0; x < image_bytes(img1->rows, img1->cols); x++) {
+        gx[x] = sqrtf(gx[x] * gx[x] + gy[x] * gy[x]);
+    }
+    free(gy);
+
+    return write_channels(new_image, gx, img1->rows, img1->cols);
+}
+
+
+
+/* Bilateral filter, approximated on a bilateral grid.
+ *
+ * Each pixel is added (as r, g, b and a weight of 1) to the nearest cell
+ * of a coarse 3D grid: one cell per sigma_s pixels across and down, and
+ * one per sigma_r levels of luminance. The grid is blurred with a
+ * [1 4 6 4 1] kernel along each of its axes, and every output pixel is
+ * read back out by trilinear interpolation at its own position and
+ * luminance, dividing the blurred color by the blurred weight. Pixels on
+ * the other side of an edge sit in far away luminance cells, so they
+ * don't get averaged in; and since cells beyond the image hold no weight
+ * the borders are renormalized just as blur does.
+ *
+ * The grid has (rows / sigma_s) x (cols / sigma_s) x (256 / sigma_r)
+ * cells, so the cost is one pass over the image plus a grid that shrinks
+ * as sigma_s grows, rather than a window that grows with it.
+ */
+
+// Radius of the grid blur
+#define GRID_RADIUS 2
+
+static const float grid_weights[2 * GRID_RADIUS + 1] = { 1, 4, 6, 4, 1 };
+
+
+/* struct to store the shared state of a (multithreaded) bilateral */
+typedef struct _bilateral_job {
+    const Image *img;
+    Image *out;
+    float *grid;            // gy x gx x gz cells of r, g, b, weight
+    float *blurred;         // the same, blurred along y
+    int gx;
+    int gy;
+    int gz;
+    float sigma_s;
+    float sigma_r;
+} BilateralJob;
+
+
+// Grid cell nearest to v, on a grid with a cell every sigma
+static int grid_cell(double v, float sigma) {
+    return (int) (v / sigma + 0.5);
+}
+
+
+// Floats in one row (constant y) of the grid
+static size_t grid_row_floats(const BilateralJob *job) {
+    return (size_t) job->gx * job->gz * 4;
+}
+
+
+// Adds the pixels of grid rows begin <= y < end into their cells; a grid
+// row only takes pixels from its own band of image rows, so threads never
+// touch the same cells
+static void bilateral_splat_rows(void *ctx, int begin, int end, int thread) {
+    BilateralJob *job = ctx;
+    (void) thread;
+
+    for (int y = begin; y < end; y++) {
+        float *row = job->grid + (size_t) y * grid_row_floats(job);
+
+        // Image rows around y * sigma_s, checked with the same rounding
+        // used for the cells
+        int first = (int) ((y - 0.5) * job->sigma_s) - 1;
+        int last = (int) ((y + 0.5) * job->sigma_s) + 1;
+        for (int i = MAX(first, 0); i <= last && i < job->img->rows; i++) {
+            if (grid_cell(i, job->sigma_s) != y) {
+                continue;
+            }
+            const Pixel *p = IMAGE_ROW(job->img, i);
+            for (int j = 0; j < job->img->cols; j++, p++) {
+                int x = grid_cell(j, job->sigma_s);
+                int z = grid_cell(pixel_to_gray(p), job->sigma_r);
+                float *cell = row + ((size_t) x * job->gz + z) * 4;
+                cell[0] += p->r;
+                cell[1] += p->g;
+                cell[2] += p->b;
+                cell[3] += 1;
+            }
+        }
+    }
+}
+
+
+// Blurs grid rows begin <= y < end along y, from grid into blurred
+static void bilateral_blur_y(void *ctx, int begin, int end, int thread) {
+    BilateralJob *job = ctx;
+    (void) thread;
+    size_t len = grid_row_floats(job);
+
+    for (int y = begin; y < end; y++) {
+        float *acc = job->blurred + (size_t) y * len;
+        memset(acc, 0, len * sizeof(float));
+        for (int k = -GRID_RADIUS; k <= GRID_RADIUS; k++) {
+            if (y + k >= 0 && y + k < job->gy) {
+                accumulate(acc, grid_weights[k + GRID_RADIUS],
+                           job->grid + (size_t) (y + k) * len, (int) len);
+            }
+        }
+    }
+}
+
+
+// Blurs grid rows begin <= y < end along x (from blurred back into grid)
+// and then along z (in place, a line of cells at a time)
+static void bilateral_blur_xz(void *ctx, int begin, int end, int thread) {
+    BilateralJob *job = ctx;
+    (void) thread;
+    int cell_floats = job->gz * 4;
+    float line[(2 * GRID_RADIUS + 1) * 4];
+
+    for (int y = begin; y < end; y++) {
+        const float *in = job->blurred + (size_t) y * grid_row_floats(job);
+        float *out = job->grid + (size_t) y * grid_row_floats(job);
+
+        // Along x: every cell column is a shifted copy of its neighbours,
+        // so whole runs of columns are accumulated at once
+        memset(out, 0, grid_row_floats(job) * sizeof(float));
+        for (int k = -GRID_RADIUS; k <= GRID_RADIUS; k++) {
+            int x0 = MAX(0, -k);
+            int x1 = MIN(job->gx, job->gx - k);
+            if (x1 > x0) {
+                accumulate(out + (size_t) x0 * cell_floats,
+                           grid_weights[k + GRID_RADIUS],
+                           in + (size_t) (x0 + k) * cell_floats,
+                           (x1 - x0) * cell_floats);
+            }
+        }
+
+        // Along z: keeps the last few unblurred cells in a small ring,
+        // since the cells are overwritten as it goes
+        for (int x = 0; x < job->gx; x++) {
+            float *cells = out + (size_t) x * cell_floats;
+            int slots = 2 * GRID_RADIUS + 1;
+            for (int z = 0; z < job->gz + GRID_RADIUS; z++) {
+                if (z < job->gz) {
+                    memcpy(line + (z % slots) * 4, cells + z * 4,
+                           4 * sizeof(float));
+                }
+                int zc = z - GRID_RADIUS;
+                if (zc < 0) {
+                    continue;
+                }
+                float sum[4] = { 0, 0, 0, 0 };
+                for (int k = -GRID_RADIUS; k <= GRID_RADIUS; k++) {
+                    if (zc + k >= 0 && zc + k < job->gz) {
+                        const float *c = line + ((zc + k) % slots) * 4;
+                        float w = grid_weights[k + GRID_RADIUS];
+                        for (int q = 0; q < 4; q++) {
+                            sum[q] += w * c[q];
+                        }
+                    }
+                }
+                memcpy(cells + zc * 4, sum, sizeof(sum));
+            }
+        }
+    }
+}
+
+
+// Reads image rows begin <= i < end back out of the blurred grid
+static void bilateral_slice_rows(void *ctx, int begin, int end, int thread) {
+    BilateralJob *job = ctx;
+    (void) thread;
+    size_t row_floats = grid_row_floats(job);
+
+    for (int i = begin; i < end; i++) {
+        const Pixel *p = IMAGE_ROW(job->img, i);
+        Pixel *out = IMAGE_ROW(job->out, i);
+        float fy = i / job->sigma_s;
+        int y0 = (int) fy;
+        float ay = fy - y0;
+
+        for (int j = 0; j < job->img->cols; j++) {
+            float fx = j / job->sigma_s;
+            float fz = pixel_to_gray(p + j) / job->sigma_r;
+            int x0 = (int) fx;
+            int z0 = (int) fz;
+            float ax = fx - x0;
+            float az = fz - z0;
+
+            // Trilinear interpolation of the 8 surrounding cells (the
+            // grid has a spare cell past the last pixel on every axis)
+            float sum[4] = { 0, 0, 0, 0 };
+            for (int dy = 0; dy < 2; dy++) {
+                for (int dx = 0; dx < 2; dx++) {
+                    const float *cell = job->grid
+                                      + (size_t) (y0 + dy) * row_floats
+                                      + ((size_t) (x0 + dx) * job->gz + z0) * 4;
+                    float w = (dy ? ay : 1 - ay) * (dx ? ax : 1 - ax);
+                    for (int q = 0; q < 4; q++) {
+                        sum[q] += w * ((1 - az) * cell[q] + az * cell[4 + q]);
+                    }
+                }
+            }
+
+            if (sum[3] > 0) {
+                out[j].r = clamp_channel(sum[0] / sum[3]);
+                out[j].g = clamp_channel(sum[1] / sum[3]);
+                out[j].b = clamp_channel(sum[2] / sum[3]);
+            } else {
+                out[j] = p[j];
+            }
+        }
+    }
+}
+
+
+
+int bilateral(Image * img1, FILE * new_image, float sigma_s, float sigma_r) {
+
+    // Checks that the parameters are valid (a grid finer than a pixel
+    // or a gray level would be no help)
+    if (!(sigma_s >= 1) || !(sigma_r >= 1)) {
+        return -1;
+    }
+
+    BilateralJob job;
+    job.img = img1;
+    job.sigma_s = sigma_s;
+    job.sigma_r = sigma_r;
+    job.gx = grid_cell(img1->cols - 1, sigma_s) + 2;
+    job.gy = grid_cell(img1->rows - 1, sigma_s) + 2;
+    job.gz = grid_cell(255, sigma_r) + 2;
+
+    // Checks the grid can be addressed
+    if (grid_row_floats(&job) > INT_MAX ||
+        grid_row_floats(&job) > SIZE_MAX / sizeof(float) / job.gy) {
+        return 0;
+    }
+    size_t count = grid_row_floats(&job) * job.gy;
+
+    job.grid = calloc(count, sizeof(float));
+    job.blurred = malloc(count * sizeof(float));
+    job.out = make_image(img1->rows, img1->cols);
+    if (!job.grid || !job.blurred || !job.out) {
+        free(job.grid);
+        free(job.blurred);
+        if (job.out) {
+            free_image(&job.out);
+        }
+        return 0;
+    }
+
+    parallel_for(job.gy, bilateral_splat_rows, &job);
+    parallel_for(job.gy, bilateral_blur_y, &job);
+    parallel_for(job.gy, bilateral_blur_xz, &job);
+    parallel_for(img1->rows, bilateral_slice_rows, &job);
+    free(job.grid);
+    free(job.blurred);
+
+    int result = write_ppm(new_image, job.out);
+    free_image(&job.out);
+
+    return result;
+}
+
+
+
+/* Motion blur, by running sums along digital lines.
+ *
+ * The streak is a line of pixels stepping one at a time along the major
+ * axis (x if the angle is within 45 degrees of horizontal, y otherwise)
+ * and shifted across it by shift[t] at step t. Every pixel lies on exactly
+ * one such line, and all the pixels of a line average the same stretch of
+ * it, just centered one step further along; so each line is walked once,
+ * adding the pixel entering the window and removing the one leaving it.
+ * The cost per pixel doesn't depend on the length. Samples that fall
+ * outside the image are left out and the rest renormalized, as in blur.
+ */
+
+/* struct to store the shared state of a (multithreaded) motion_blur */
+typedef struct _motion_job {
+    const Image *img;
+    Image *out;
+    const int *shift;       // offset across the major axis at each step
+    int steps;              // length of the major axis
+    int x_major;            // nonzero if the major axis is x
+    int first_line;         // offset of line 0 across the major axis
+    int radius;             // steps either side of the center
+} MotionJob;
+
+
+// Index of step t of the line at offset c, or -1 if it's outside the image
+static ptrdiff_t motion_point(const MotionJob *job, int c, int t) {
+    int across = c + job->shift[t];
+    if (job->x_major) {
+        return across >= 0 && across < job->img->rows ?
+               (ptrdiff_t) across * job->img->cols + t : -1;
+    }
+    return across >= 0 && across < job->img->cols ?
+           (ptrdiff_t) t * job->img->cols + across : -1;
+}
+
+
+// Blurs lines begin <= line < end; lines share no pixels, so parallel_for
+// can hand each thread its own set
+static void motion_lines(void *ctx, int begin, int end, int thread) {
+    MotionJob *job = ctx;
+    (void) thread;
+    const Pixel *in = job->img->data;
+
+    for (int line = begin; line < end; line++) {
+        int c = job->first_line + line;
+        long long sum_r = 0;
+        long long sum_g = 0;
+        long long sum_b = 0;
+        long long count = 0;
+
+        // Primes the window with the steps before the first center
+        for (int t = 0; t < job->radius && t < job->steps; t++) {
+            ptrdiff_t k = motion_point(job, c, t);
+            if (k >= 0) {
+                sum_r += in[k].r;
+                sum_g += in[k].g;
+                sum_b += in[k].b;
+                count++;
+            }
+        }
+
+        for (int t = 0; t < job->steps; t++) {
+            if (t + job->radius < job->steps) {
+                ptrdiff_t k = motion_point(job, c, t + job->radius);
+                if (k >= 0) {
+                    sum_r += in[k].r;
+                    sum_g += in[k].g;
+                    sum_b += in[k].b;
+                    count++;
+                }
+            }
+            if (t - job->radius - 1 >= 0) {
+                ptrdiff_t k = motion_point(job, c, t - job->radius - 1);
+                if (k >= 0) {
+                    sum_r -= in[k].r;
+                    sum_g -= in[k].g;
+                    sum_b -= in[k].b;
+                    count--;
+                }
+            }
+
+            // The center is in the window, so count is at least 1 here
+            ptrdiff_t k = motion_point(job, c, t);
+            if (k >= 0) {
+                job->out->data[k].r = (sum_r + count / 2) / count;
+                job->out->data[k].g = (sum_g + count / 2) / count;
+                job->out->data[k].b = (sum_b + count / 2) / count;
+            }
+        }
+    }
+}
+
+
+
+int motion_blur(Image * img1, FILE * new_image, float length, float angle) {
+
+    // Checks that the length is valid
+    if (!(length >= 1) || !isfinite(angle)) {
+        return -1;
+    }
+
+    // Direction of the streak; image rows count downwards, so a positive
+    // (counter-clockwise) angle goes up
+    double dx = cos(angle * PI / 180);
+    double dy = -sin(angle * PI / 180);
+
+    MotionJob job;
+    job.img = img1;
+    job.x_major = fabs(dx) >= fabs(dy);
+    job.steps = job.x_major ? img1->cols : img1->rows;
+    int across = job.x_major ? img1->rows : img1->cols;
+    double slope = job.x_major ? dy / dx : dx / dy;
+
+    // A streak length pixels long spans this many steps either side
+    // of its center pixel
+    double major = job.x_major ? fabs(dx) : fabs(dy);
+    job.radius = (int) MIN((length * major - 1) / 2 + 0.5, job.steps);
+
+    int *shift = malloc(sizeof(int) * job.steps);
+    job.out = make_image(img1->rows, img1->cols);
+    if (!shift || !job.out) {
+        free(shift);
+        if (job.out) {
+            free_image(&job.out);
+        }
+        return 0;
+    }
+    for (int t = 0; t < job.steps; t++) {
+        shift[t] = (int) floor(t * slope + 0.5);
+    }
+    job.shift = shift;
+
+    // Lines start anywhere a pixel of theirs can still land in the image
+    int last = shift[job.steps - 1];
+    job.first_line = -MAX(last, 0);
+    long long lines = (long long) across + abs(last);
+
+    int result = 0;
+    if (lines <= INT_MAX) {
+        parallel_for((int) lines, motion_lines, &job);
+        result = write_ppm(new_image, job.out);
+    }
+
+    free(shift);
+    free_image(&job.out);
+
+    return result;
+}
+
+
+
+/* Median filter.
+ *
+ * Each channel of each output pixel is the median of that channel over the
+ * (2 radius + 1)^2 window around it, counting only the part of the window
+ * inside the image (as blur leaves out pixels beyond the border).
+ *
+ * The general case follows Perreault and Hebert: every column keeps a
+ * histogram of the 2 radius + 1 pixels above and below the current row,
+ * updated by one removal and one insertion as the row moves down; the
+ * window histogram is the sum of 2 radius + 1 column histograms, updated
+ * as it moves right by adding one column histogram and subtracting
+ * another. Neither depends on the radius, so neither does the cost per
+ * pixel. Histograms have 16 coarse bins over the 256 fine ones: the
+ * window's coarse bins are kept up to date, but a group of 16 fine bins
+ * is only brought up to date when the median falls in it, and the median
+ * is found by scanning at most 16 + 16 bins. The image is worked
+ * through in vertical strips of MEDIAN_STRIP columns, so a strip's column
+ * histograms stay in cache, and the strips are split across threads.
+ *
+ * For radius 1 and 2 a selection network (a fixed sequence of min/max
+ * exchanges) is quicker. It is run on 16 neighbouring pixels at a time:
+ * their 48 channel bytes are contiguous in every row of the window, so
+ * each exchange is a single elementwise min/max over 48 bytes.
+ */
+
+// Largest radius, so window counts fit in 16 bits
+#define MEDIAN_MAX_RADIUS 127
+
+// Columns per strip in the histogram method
+#define MEDIAN_STRIP 256
+
+// Pixels (of 3 bytes each) handled at once by the selection networks
+#define MEDIAN_LANES 16
+
+
+/* struct to store a histogram of one channel, with a coarse bin for
+ * every 16 fine ones */
+typedef struct _median_histogram {
+    uint16_t coarse[16];
+    uint16_t fine[256];
+} MedianHistogram;
+
+
+/* struct to store the shared state of a (multithreaded) median */
+typedef struct _median_job {
+    const Image *img;
+    Image *out;
+    int radius;
+    MedianHistogram *hist;  // column histograms, hist_count per thread
+    size_t hist_count;
+} MedianJob;
+
+
+/* struct to store the window histogram of one channel: the coarse bins
+ * are kept up to date as the window slides, but each group of 16 fine
+ * bins only once the median lands in it; synced[c] is the column the
+ * window was centered on when group c was last brought up to date */
+typedef struct _median_window {
+    int coarse[16];
+    uint16_t fine[256];
+    int synced[16];
+} MedianWindow;
+
+
+// Adds (delta 1) or subtracts (delta -1) fine bins 16c..16c+15 of a
+// column histogram into a window
+static void window_update_fine(MedianWindow *w, const MedianHistogram *h,
+                               int c, int delta) {
+    uint16_t *fine = w->fine + 16 * c;
+    const uint16_t *in = h->fine + 16 * c;
+    if (delta > 0) {
+        for (int v = 0; v < 16; v++) {
+            fine[v] += in[v];
+        }
+    } else {
+        for (int v = 0; v < 16; v++) {
+            fine[v] -= in[v];
+        }
+    }
+}
+
+
+/* Brings fine group c of window w up to date for the window centered on
+ * column j: from the columns that entered and left since it was last
+ * synced, or from scratch if that's more of them; col(k) is the column
+ * histogram of column k */
+static void window_sync(MedianWindow *w, const MedianHistogram *hist,
+                        int stride, int c0, int cols, int r, int j, int c) {
+#define COLUMN(k) (hist + (size_t) ((k) - c0) * stride)
+    if (j - w->synced[c] > 2 * r) {
+        memset(w->fine + 16 * c, 0, 16 * sizeof(uint16_t));
+        for (int k = MAX(j - r, 0); k <= j + r && k < cols; k++) {
+            window_update_fine(w, COLUMN(k), c, 1);
+        }
+    } else {
+        for (int k = w->synced[c] + 1; k <= j; k++) {
+            if (k + r < cols) {
+                window_update_fine(w, COLUMN(k + r), c, 1);
+            }
+            if (k - r - 1 >= 0) {
+                window_update_fine(w, COLUMN(k - r - 1), c, -1);
+            }
+        }
+    }
+    w->synced[c] = j;
+#undef COLUMN
+}
+
+
+// Returns the value with rank values below it (counting from 0) in the
+// window centered on column j, syncing only the fine group it's in
+static int window_select(MedianWindow *w, const MedianHistogram *hist,
+                         int stride, int c0, int cols, int r, int j,
+                         int rank) {
+    int c = 0;
+    int below = 0;
+    while (below + w->coarse[c] <= rank) {
+        below += w->coarse[c++];
+    }
+
+    window_sync(w, hist, stride, c0, cols, r, j, c);
+    int v = c * 16;
+    while (below + w->fine[v] <= rank) {
+        below += w->fine[v++];
+    }
+    return v;
+}
+
+
+// Inserts (delta 1) or removes (delta -1) columns c0 <= c < c1 of row i
+// into the column histograms, which start at column c0
+static void histogram_update_row(MedianHistogram *hist, const Image *img,
+                                 int i, int c0, int c1, int delta) {
+    const Pixel *p = IMAGE_ROW(img, i) + c0;
+    for (int c = c0; c < c1; c++, p++, hist += 3) {
+        hist[0].coarse[p->r >> 4] += delta;
+        hist[0].fine[p->r] += delta;
+        hist[1].coarse[p->g >> 4] += delta;
+        hist[1].fine[p->g] += delta;
+        hist[2].coarse[p->b >> 4] += delta;
+        hist[2].fine[p->b] += delta;
+    }
+}
+
+
+/* Filters columns s0 <= j < s1 with the histogram method; hist has room
+ * for the strip's columns plus radius either side, three channels each */
+static void median_strip(const MedianJob *job, MedianHistogram *hist,
+                         int s0, int s1) {
+    const Image *img = job->img;
+    int r = job->radius;
+    int c0 = MAX(s0 - r, 0);
+    int c1 = MIN(s1 + r, img->cols);
+    MedianWindow window[3];
+
+    // Column histograms for the window of row 0
+    memset(hist, 0, sizeof(MedianHistogram) * 3 * (c1 - c0));
+    for (int y = 0; y <= r && y < img->rows; y++) {
+        histogram_update_row(hist, img, y, c0, c1, 1);
+    }
+
+    for (int i = 0; i < img->rows; i++) {
+        // Moves the column histograms down to row i
+        if (i > 0) {
+            if (i - r - 1 >= 0) {
+                histogram_update_row(hist, img, i - r - 1, c0, c1, -1);
+            }
+            if (i + r < img->rows) {
+                histogram_update_row(hist, img, i + r, c0, c1, 1);
+            }
+        }
+        int window_rows = MIN(i + r, img->rows - 1) - MAX(i - r, 0) + 1;
+
+        // Coarse bins for the window around column s0; every fine group
+        // starts out of date
+        for (int ch = 0; ch < 3; ch++) {
+            memset(window[ch].coarse, 0, sizeof(window[ch].coarse));
+            for (int c = MAX(s0 - r, 0); c <= s0 + r && c < img->cols; c++) {
+                for (int v = 0; v < 16; v++) {
+                    window[ch].coarse[v] += hist[(c - c0) * 3 + ch].coarse[v];
+                }
+            }
+            for (int v = 0; v < 16; v++) {
+                window[ch].synced[v] = s0 - 2 * r - 1;
+            }
+        }
+
+        Pixel *out = IMAGE_ROW(job->out, i);
+        for (int j = s0; j < s1; j++) {
+            int window_cols = MIN(j + r, img->cols - 1) - MAX(j - r, 0) + 1;
+            int rank = (window_rows * window_cols - 1) / 2;
+            out[j].r = window_select(&window[0], hist, 3, c0, img->cols, r,
+                                     j, rank);
+            out[j].g = window_select(&window[1], hist + 1, 3, c0, img->cols,
+                                     r, j, rank);
+            out[j].b = window_select(&window[2], hist + 2, 3, c0, img->cols,
+                                     r, j, rank);
+
+            // Slides the coarse bins one column right
+            for (int ch = 0; ch < 3; ch++) {
+                int *coarse = window[ch].coarse;
+                if (j + r + 1 < c1) {
+                    const uint16_t *in = hist[(j + r + 1 - c0) * 3 + ch].coarse;
+                    for (int v = 0; v < 16; v++) {
+                        coarse[v] += in[v];
+                    }
+                }
+                if (j - r >= 0) {
+                    const uint16_t *gone = hist[(j - r - c0) * 3 + ch].coarse;
+                    for (int v = 0; v < 16; v++) {
+                        coarse[v] -= gone[v];
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+// Filters the strips of columns begin <= j < end
+static void median_strips(void *ctx, int begin, int end, int thread) {
+    MedianJob *job = ctx;
+    MedianHistogram *hist = job->hist + job->hist_count * thread;
+
+    for (int s0 = begin; s0 < end; s0 += MEDIAN_STRIP) {
+        median_strip(job, hist, s0, MIN(s0 + MEDIAN_STRIP, end));
+    }
+}
+
+
+/* Median of the part of the window around pixel (i, j) inside the image,
+ * by sorting; used at the borders by the selection network path */
+static Pixel median_pixel(const Image *img, int r, int i, int j) {
+    unsigned char values[3][sq(2 * 2 + 1)];
+    int count = 0;
+
+    for (int m = MAX(i - r, 0); m <= i + r && m < img->rows; m++) {
+        for (int l = MAX(j - r, 0); l <= j + r && l < img->cols; l++) {
+            const Pixel *p = IMAGE_ROW(img, m) + l;
+            unsigned char v[3] = { p->r, p->g, p->b };
+
+            // Insertion sort, one channel at a time
+            for (int ch = 0; ch < 3; ch++) {
+                int k = count;
+                while (k > 0 && values[ch][k - 1] > v[ch]) {
+                    values[ch][k] = values[ch][k - 1];
+                    k--;
+                }
+                values[ch][k] = v[ch];
+            }
+            count++;
+        }
+    }
+
+    Pixel p;
+    p.r = values[0][(count - 1) / 2];
+    p.g = values[1][(count - 1) / 2];
+    p.b = values[2][(count - 1) / 2];
+    return p;
+}
+
+
+// Exchanges a and b lane by lane so a holds the smaller of each pair
+static void median_exchange(unsigned char *a, unsigned char *b) {
+#ifdef __SSE2__
+    for (int q = 0; q < 3 * MEDIAN_LANES; q += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + q));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + q));
+        _mm_storeu_si128((__m128i *) (a + q), _mm_min_epu8(va, vb));
+        _mm_storeu_si128((__m128i *) (b + q), _mm_max_epu8(va, vb));
+    }
+#else
+    for (int q = 0; q < 3 * MEDIAN_LANES; q++) {
+        unsigned char lo = MIN(a[q], b[q]);
+        unsigned char hi = MAX(a[q], b[q]);
+        a[q] = lo;
+        b[q] = hi;
+    }
+#endif
+}
+
+
+// Returns the median of v[0..8] (Paeth's 19 exchange network)
+static const unsigned char *median_network_9(unsigned char v[9][3 * MEDIAN_LANES]) {
+    static const unsigned char pairs[19][2] = {
+        {1, 2}, {4, 5}, {7, 8}, {0, 1}, {3, 4}, {6, 7}, {1, 2}, {4, 5},
+        {7, 8}, {0, 3}, {5, 8}, {4, 7}, {3, 6}, {1, 4}, {2, 5}, {4, 7},
+        {4, 2}, {6, 4}, {4, 2}
+    };
+    for (int e = 0; e < 19; e++) {
+        median_exchange(v[pairs[e][0]], v[pairs[e][1]]);
+    }
+    return v[4];
+}
+
+
+/* Returns the median of v[0..24], by forgetful selection: of the
+ * first 14 values, the smallest and largest can't be the median (11 are
+ * still to come), so they are dropped and the next value taken in, and so
+ * on until three are left */
+static const unsigned char *median_network_25(unsigned char v[25][3 * MEDIAN_LANES]) {
+    unsigned char *set[14];
+    int size = 14;
+    for (int k = 0; k < size; k++) {
+        set[k] = v[k];
+    }
+
+    for (int next = 14; ; next++) {
+        for (int k = 1; k < size; k++) {
+            median_exchange(set[0], set[k]);
+        }
+        for (int k = 1; k < size - 1; k++) {
+            median_exchange(set[k], set[size - 1]);
+        }
+        if (next == 25) {
+            break;
+        }
+
+        // Drops the smallest and largest, takes in the next value
+        for (int k = 1; k < size - 1; k++) {
+            set[k - 1] = set[k];
+        }
+        set[size - 2] = v[next];
+        size--;
+    }
+
+    // With three left, the middle one is the median
+    return set[1];
+}
+
+
+// Filters rows begin <= i < end with the selection networks (radius 1
+// or 2), leaving the borders to median_pixel
+static void median_network_rows(void *ctx, int begin, int end, int thread) {
+    MedianJob *job = ctx;
+    (void) thread;
+    const Image *img = job->img;
+    int r = job->radius;
+    int n = 2 * r + 1;
+    unsigned char v[25][3 * MEDIAN_LANES];
+
+    for (int i = begin; i < end; i++) {
+        Pixel *out = IMAGE_ROW(job->out, i);
+        int j = 0;
+
+        if (i >= r && i < img->rows - r) {
+            for (; j < r; j++) {
+                out[j] = median_pixel(img, r, i, j);
+            }
+            for (; j + MEDIAN_LANES <= img->cols - r; j += MEDIAN_LANES) {
+                for (int m = 0; m < n; m++) {
+                    const Pixel *row = IMAGE_ROW(img, i - r + m) + j - r;
+                    for (int l = 0; l < n; l++) {
+                        memcpy(v[m * n + l], row + l, 3 * MEDIAN_LANES);
+                    }
+                }
+                const unsigned char *mid = r == 1 ? median_network_9(v)
+                                                  : median_network_25(v);
+                memcpy(out + j, mid, 3 * MEDIAN_LANES);
+            }
+        }
+
+        for (; j < img->cols; j++) {
+            out[j] = median_pixel(img, r, i, j);
+        }
+    }
+}
+
+
+
+int median(Image * img1, FILE * new_image, int radius) {
+
+    // Checks that the radius is valid
+    if (radius < 0 || radius > MEDIAN_MAX_RADIUS) {
+        return -1;
+    }
+
+    MedianJob job;
+    job.img = img1;
+    job.radius = radius;
+    job.out = make_image(img1->rows, img1->cols);
+    if (!job.out) {
+        return 0;
+    }
+
+    if (radius == 0) {
+        memcpy(job.out->data, img1->data,
+               image_bytes(img1->rows, img1->cols));
+    } else if (specialized_kernels && radius <= 2) {
+        parallel_for(img1->rows, median_network_rows, &job);
+    } else {
+        // Each thread gets column histograms for one strip at a time
+        job.hist_count = (size_t) 3 * (MEDIAN_STRIP + 2 * radius);
+        job.hist = malloc(sizeof(MedianHistogram) * job.hist_count *
+                          parallel_threads());
+        if (!job.hist) {
+            free_image(&job.out);
+            return 0;
+        }
+        parallel_for(img1->cols, median_strips, &job);
+        free(job.hist);
+    }
+
+    int result = write_ppm(new_image, job.out);
+    free_image(&job.out);
+
+    return result;
+}
+
+
+
+/* struct to store the shared state of compute_stats: one private set
+ * of histograms per thread, merged once every thread is done */
+typedef struct _stats_job {
+    const Image *img;
+    unsigned long long (*histograms)[STATS_CHANNELS][256];
+} StatsJob;
+
+
+// Counts the pixels of rows begin..end into this thread's histograms
+static void stats_rows(void *ctx, int begin, int end, int thread) {
+    StatsJob *job = ctx;
+    unsigned long long (*hist)[256] = job->histograms[thread];
+    const Pixel *p = IMAGE_ROW(job->img, begin);
+    const Pixel *last = IMAGE_ROW(job->img, end);
+
+    for (; p < last; p++) {
+        hist[STATS_RED][p->r]++;
+        hist[STATS_GREEN][p->g]++;
+        hist[STATS_BLUE][p->b]++;
+        hist[STATS_LUMINANCE][pixel_to_gray(p)]++;
+    }
+}
+
+
+
+int compute_stats(const Image *img, ImageStats *stats) {
+    int threads = parallel_threads();
+
+    StatsJob job;
+    job.img = img;
+    job.histograms = calloc(threads, sizeof(*job.histograms));
+    if (!job.histograms) {
+        return -1;
+    }
+    parallel_for(img->rows, stats_rows, &job);
+
+    // Merges the per-thread histograms
+    memset(stats, 0, sizeof(*stats));
+    stats->pixels = (long long) img->rows * img->cols;
+    for (int t = 0; t < threads; t++) {
+        for (int c = 0; c < STATS_CHANNELS; c++) {
+            for (int v = 0; v < 256; v++) {
+                stats->histogram[c][v] += job.histograms[t][c][v];
+            }
+        }
+    }
+    free(job.histograms);
+
+    // Everything else follows from the histograms
+    for (int c = 0; c < STATS_CHANNELS; c++) {
+        const unsigned long long *hist = stats->histogram[c];
+        double sum = 0;
+        double sum_sq = 0;
+
+        stats->min[c] = -1;
+        for (int v = 0; v < 256; v++) {
+            if (hist[v]) {
+                if (stats->min[c] < 0) {
+                    stats->min[c] = v;
+                }
+                stats->max[c] = v;
+                sum += (double) hist[v] * v;
+                sum_sq += (double) hist[v] * v * v;
+            }
+        }
+
+        stats->mean[c] = sum / stats->pixels;
+        double variance = sum_sq / stats->pixels - sq(stats->mean[c]);
+        stats->stddev[c] = sqrt(MAX(variance, 0));
+    }
+
+    return 0;
+}
+
+
+
+int otsu_threshold(const ImageStats *stats) {
+    const unsigned long long *hist = stats->histogram[STATS_LUMINANCE];
+
+    double total = 0;
+    for (int v = 0; v < 256; v++) {
+        total += (double) hist[v] * v;
+    }
+
+    // Tries every split "gray <= t" vs "gray > t", keeping the one with
+    // the largest between-class variance
+    double weight_low = 0;
+    double sum_low = 0;
+    double best = -1;
+    int best_t = 0;
+    for (int t = 0; t < 255; t++) {
+        weight_low += hist[t];
+        sum_low += (double) hist[t] * t;
+
+        double weight_high = stats->pixels - weight_low;
+        if (weight_low == 0 || weight_high == 0) {
+            continue;
+        }
+
+        double mean_low = sum_low / weight_low;
+        double mean_high = (total - sum_low) / weight_high;
+        double between = weight_low * weight_high * sq(mean_low - mean_high);
+        if (between > best) {
+            best = between;
+            best_t = t;
+        }
+    }
+
+    // binarize makes pixels below the threshold black
+    return best_t + 1;
+}
+
+
+
+// Writes one channel's statistics as a JSON object
+static void write_channel_json(FILE *output, const ImageStats *s, int c,
+                               const char *name, int with_histograms,
+                               int last) {
+    fprintf(output, "    \"%s\": {\n", name);
+    fprintf(output, "      \"min\": %d,\n", s->min[c]);
+    fprintf(output, "      \"max\": %d,\n", s->max[c]);
+    fprintf(output, "      \"mean\": %.4f,\n", s->mean[c]);
+    fprintf(output, "      \"stddev\": %.4f%s\n", s->stddev[c],
+            with_histograms ? "," : "");
+
+    if (with_histograms) {
+        fprintf(output, "      \"histogram\": [");
+        for (int v = 0; v < 256; v++) {
+            fprintf(output, "%s%llu", v ? ", " : "", s->histogram[c][v]);
+        }
+        fprintf(output, "]\n");
+    }
+
+    fprintf(output, "    }%s\n", last ? "" : ",");
+}
+
+
+
+int stats(Image * img1, FILE * output, int with_histograms) {
+    ImageStats s;
+    if (compute_stats(img1, &s) != 0) {
+        return 0;
+    }
+
+    fprintf(output, "{\n");
+    fprintf(output, "  \"width\": %d,\n", img1->cols);
+    fprintf(output, "  \"height\": %d,\n", img1->rows);
+    fprintf(output, "  \"pixels\": %lld,\n", s.pixels);
+    fprintf(output, "  \"otsu_threshold\": %d,\n", otsu_threshold(&s));
+    fprintf(output, "  \"channels\": {\n");
+    write_channel_json(output, &s, STATS_RED, "red", with_histograms, 0);
+    write_channel_json(output, &s, STATS_GREEN, "green", with_histograms, 0);
+    write_channel_json(output, &s, STATS_BLUE, "blue", with_histograms, 0);
+    write_channel_json(output, &s, STATS_LUMINANCE, "luminance",
+                       with_histograms, 1);
+    fprintf(output, "  }\n");
+    fprintf(output, "}\n");
+
+    return ferror(output) ? 0 : 1;
+}
+
+
+
+/* struct to store the lookup tables for equalize */
+typedef struct _equalize_job {
+    Image *img;
+    unsigned char map[3][256];
+} EqualizeJob;
+
+
+// Remaps the pixels of rows begin..end through the lookup tables
+static void equalize_rows(void *ctx, int begin, int end, int thread) {
+    EqualizeJob *job = ctx;
+    Pixel *p = IMAGE_ROW(job->img, begin);
+    Pixel *last = IMAGE_ROW(job->img, end);
+    (void) thread;
+
+    for (; p < last; p++) {
+        p->r = job->map[STATS_RED][p->r];
+        p->g = job->map[STATS_GREEN][p->g];
+        p->b = job->map[STATS_BLUE][p->b];
+    }
+}
+
+
+
+int equalize(Image * img1, FILE * new_image) {
+    ImageStats s;
+    if (compute_stats(img1, &s) != 0) {
+        return 0;
+    }
+
+    // Maps each value through its channel's cumulative histogram,
+    // stretched so the darkest value present becomes 0 and the
+    // brightest 255
+    EqualizeJob job;
+    job.img = img1;
+    for (int c = 0; c < 3; c++) {
+        const unsigned long long *hist = s.histogram[c];
+        unsigned long long cdf_min = hist[s.min[c]];
+        unsigned long long cdf = 0;
+
+        for (int v = 0; v < 256; v++) {
+            cdf += hist[v];
+            if (s.pixels == (long long) cdf_min) {
+                // Single-valued channel: leave it as it is
+                job.map[c][v] = v;
+            } else {
+                job.map[c][v] = (unsigned char)
+                        ((cdf < cdf_min ? 0 : cdf - cdf_min) * 255.0
+                         / (s.pixels - cdf_min) + 0.5);
+            }
+        }
+    }
+
+    // Modifies the image in place, like binarize
+    parallel_for(img1->rows, equalize_rows, &job);
+
+    return write_ppm(new_image, img1);
+}
+
+
+
+int images_equal(const Image *a, const Image *b) {
+    if (a->rows != b->rows || a->cols != b->cols) {
+        return 0;
+    }
+
+    // memcmp stops at the first difference
+    return memcmp(a->data, b->data,
+                  image_bytes(a->rows, a->cols)) == 0;
+}
+
+
+
+/* struct to store one thread's share of diff_images */
+typedef struct _diff_part {
+    unsigned long long sum_sq;
+    int max_diff;
+    long long differing;
+} DiffPart;
+
+/* struct to store the shared state of diff_images */
+typedef struct _diff_job {
+    const Image *a;
+    const Image *b;
+    Image *mask;
+    DiffPart *parts;
+} DiffJob;
+
+
+// Sums squared byte differences and tracks the largest over len bytes
+static void diff_bytes(const unsigned char *a, const unsigned char *b,
+                       size_t len, DiffPart *part) {
+    size_t x = 0;
+    unsigned long long sum_sq = 0;
+    int max_diff = 0;
+
+#ifdef __SSE2__
+    // 16 bytes at a time: |a - b| from two saturating subtracts, squares
+    // summed pairwise into 32-bit lanes, which are flushed to 64 bits
+    // before they can overflow
+    const __m128i zero = _mm_setzero_si128();
+    __m128i vmax = zero;
+    while (x + 16 <= len) {
+        __m128i acc = zero;
+        for (int block = 0; block < 4096 && x + 16 <= len; block++, x += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i *) (a + x));
+            __m128i vb = _mm_loadu_si128((const __m128i *) (b + x));
+            __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb),
+                                     _mm_subs_epu8(vb, va));
+            vmax = _mm_max_epu8(vmax, d);
+            __m128i lo = _mm_unpacklo_epi8(d, zero);
+            __m128i hi = _mm_unpackhi_epi8(d, zero);
+            acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_madd_epi16(lo, lo),
+                                                   _mm_madd_epi16(hi, hi)));
+        }
+        unsigned int lanes[4];
+        _mm_storeu_si128((__m128i *) lanes, acc);
+        sum_sq += (unsigned long long) lanes[0] + lanes[1] + lanes[2]
+                + lanes[3];
+    }
+    unsigned char maxes[16];
+    _mm_storeu_si128((__m128i *) maxes, vmax);
+    for (int q = 0; q < 16; q++) {
+        max_diff = MAX(max_diff, maxes[q]);
+    }
+#endif
+
+    for (; x < len; x++) {
+        int d = abs(a[x] - b[x]);
+        sum_sq += d * d;
+        max_diff = MAX(max_diff, d);
+    }
+
+    part->sum_sq += sum_sq;
+    part->max_diff = MAX(part->max_diff, max_diff);
+}
+
+
+// Diffs rows begin..end into this thread's DiffPart, filling the mask
+static void diff_rows(void *ctx, int begin, int end, int thread) {
+    DiffJob *job = ctx;
+    DiffPart *part = &job->parts[thread];
+    int cols = job->a->cols;
+    size_t first = (size_t) begin * cols;
+    size_t count = (size_t) (end - begin) * cols;
+    const Pixel *pa = job->a->data + first;
+    const Pixel *pb = job->b->data + first;
+
+    diff_bytes((const unsigned char *) pa, (const unsigned char *) pb,
+               count * sizeof(Pixel), part);
+
+    // Per-pixel pass, only needed if there's any difference at all
+    if (part->max_diff == 0 && !job->mask) {
+        return;
+    }
+    for (size_t k = 0; k < count; k++) {
+        int differs = pa[k].r != pb[k].r || pa[k].g != pb[k].g ||
+                      pa[k].b != pb[k].b;
+        part->differing += differs;
+        if (job->mask) {
+            Pixel *m = job->mask->data + first + k;
+            m->r = m->g = m->b = differs ? 255 : 0;
+        }
+    }
+}
+
+
+
+int diff_images(const Image *a, const Image *b, ImageDiff *diff,
+                Image *mask) {
+    if (a->rows != b->rows || a->cols != b->cols) {
+        return -1;
+    }
+    if (mask && (mask->rows != a->rows || mask->cols != a->cols)) {
+        return -1;
+    }
+
+    DiffJob job;
+    job.a = a;
+    job.b = b;
+    job.mask = mask;
+    job.parts = calloc(parallel_threads(), sizeof(DiffPart));
+    if (!job.parts) {
+        return -2;
+    }
+    parallel_for(a->rows, diff_rows, &job);
+
+    unsigned long long sum_sq = 0;
+    memset(diff, 0, sizeof(*diff));
+    for (int t = 0; t < parallel_threads(); t++) {
+        sum_sq += job.parts[t].sum_sq;
+        diff->max_diff = MAX(diff->max_diff, job.parts[t].max_diff);
+        diff->differing += job.parts[t].differing;
+    }
+    free(job.parts);
+
+    diff->mse = (double) sum_sq / (3.0 * a->rows * a->cols);
+    diff->psnr = diff->mse == 0 ? INFINITY
+                                : 10 * log10(sq(255.0) / diff->mse);
+
+    return 0;
+}
+
+
+
+uint64_t image_dhash(const Image *img) {
+
+    // Averages the grayscale image over a 9 wide x 8 high grid of cells
+    double cells[8][9] = { { 0 } };
+    long long counts[8][9] = { { 0 } };
+    for (int i = 0; i < img->rows; i++) {
+        int ci = (long long) i * 8 / img->rows;
+        const Pixel *row = IMAGE_ROW(img, i);
+        for (int j = 0; j < img->cols; j++) {
+            int cj = (long long) j * 9 / img->cols;
+            cells[ci][cj] += pixel_to_gray(row + j);
+            counts[ci][cj]++;
+        }
+    }
+
+    // Sets one bit per horizontally adjacent pair of cells
+    uint64_t hash = 0;
+    for (int ci = 0; ci < 8; ci++) {
+        for (int cj = 0; cj < 8; cj++) {
+            double left = counts[ci][cj] ? cells[ci][cj] / counts[ci][cj] : 0;
+            double right = counts[ci][cj + 1] ?
+                           cells[ci][cj + 1] / counts[ci][cj + 1] : 0;
+            hash = (hash << 1) | (left > right);
+        }
+    }
+
+    return hash;
+}
+
+
+
+int hash_distance(uint64_t a, uint64_t b) {
+    uint64_t x = a ^ b;
+#ifdef __GNUC__
+    return __builtin_popcountll(x);
+#else
+    int bits = 0;
+    for (; x; x &= x - 1) {
+        bits++;
+    }
+    return bits;
+#endif
+}
+
+
+
+int compare(Image * img1, FILE * new_image, Image * img2) {
+    Image *mask = make_image(img1->rows, img1->cols);
+    if (!mask) {
+        return -2;
+    }
+
+    ImageDiff diff;
+    int diffed = diff_images(img1, img2, &diff, mask);
+    if (diffed != 0) {
+        free_image(&mask);
+        return diffed;
+    }
+
+    printf("psnr: %.4f dB\n", diff.psnr);
+    printf("mse: %.4f\n", diff.mse);
+    printf("max diff: %d\n", diff.max_diff);
+    printf("differing pixels: %lld\n", diff.differing);
+    printf("hash distance: %d\n",
+           hash_distance(image_dhash(img1), image_dhash(img2)));
+
+    int result = write_ppm(new_image, mask);
+    free_image(&mask);
+
+    return result;
 }
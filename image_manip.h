@@ -1,6 +1,7 @@
 #ifndef IMAGE_MANIP_H
 #define IMAGE_MANIP_H
 
+#include <stdint.h>
 #include "ppm_io.h"
 
 // store PI as a constant
@@ -12,6 +13,67 @@
 // macro to find the max of a number
 #define MAX(a,b) ((a > b) ? (a) : (b))
 
+// macro to find the min of a number
+#define MIN(a,b) ((a < b) ? (a) : (b))
+
+
+/* how convolution treats pixels beyond the image border */
+typedef enum _border_mode {
+    BORDER_CLAMP,          // repeat the edge pixel
+    BORDER_MIRROR,         // reflect about the edge pixel
+    BORDER_ZERO,           // treat as black
+    BORDER_RENORMALIZE     // leave out, and rescale by the kernel weight
+                           // that's left (as blur does)
+} BorderMode;
+
+/* struct to store a convolution kernel; width and height are odd and
+ * the kernel is centered on the middle weight */
+typedef struct _conv_kernel {
+    int width;
+    int height;
+    double *weights;       // height x width, row-major
+} ConvKernel;
+
+// largest kernel width or height (kernels are read from untrusted files)
+#define CONV_MAX_SIZE 1023
+
+
+/* how rotate and affine sample the input between pixel centers */
+typedef enum _interpolation {
+    INTERP_NEAREST,        // take the nearest pixel
+    INTERP_BILINEAR        // blend the four nearest pixels
+} Interpolation;
+
+
+/* output formats of the packed binarize paths */
+typedef enum _binary_format {
+    BINARY_PBM,            // P4: one bit per pixel, set for black
+    BINARY_PGM             // P5: one byte per pixel, 0 or 255
+} BinaryFormat;
+
+
+/* indexes into the ImageStats arrays */
+enum { STATS_RED, STATS_GREEN, STATS_BLUE, STATS_LUMINANCE, STATS_CHANNELS };
+
+/* struct to store per-channel and luminance statistics of an image */
+typedef struct _image_stats {
+    long long pixels;
+    unsigned long long histogram[STATS_CHANNELS][256];
+    int min[STATS_CHANNELS];
+    int max[STATS_CHANNELS];
+    double mean[STATS_CHANNELS];
+    double stddev[STATS_CHANNELS];
+} ImageStats;
+
+
+/* struct to store how far apart two same-sized images are */
+typedef struct _image_diff {
+    double mse;            // mean squared error over every channel
+    double psnr;           // peak signal-to-noise ratio in dB (INFINITY if equal)
+    int max_diff;          // largest absolute channel difference
+    long long differing;   // number of pixels with any channel different
+} ImageDiff;
+
 
 /* HELPER for binarize:
  * convert a RGB pixel to a single grayscale intensity;
@@ -20,12 +82,45 @@
 unsigned char pixel_to_gray (const Pixel *p);
 
 
+/* enable (nonzero) or disable the compile-time specialized kernels
+ * for common blur widths and zoom factors; disabling falls back to
+ * the generic code paths, which produce identical output
+ */
+void use_specialized_kernels(int enable);
+
+
+/* Enable (nonzero) or disable in-place mode, in which crop, zoom_in,
+ * zoom, rotate_left, pointillism and blur work inside the input image's
+ * own buffer (resizing it as needed) rather than allocating a second
+ * full-size image. The input image is left holding the result.
+ */
+void use_in_place(int enable);
+
+
 //______binarize___
 /* convert image to black and white only based on threshold value
  */
 int binarize(Image * img1, FILE * new_img, float thrshld);
 
 
+/* binarize, but write a 1-bit P4 or 8-bit P5 file rather than a P6 with
+ * the value repeated in all three channels; returns -1 for an invalid
+ * threshold, 0 if out of memory or the write fails, otherwise the number
+ * of pixels written (saturating at INT_MAX)
+ */
+int binarize_packed(Image * img1, FILE * new_img, float thrshld,
+                    BinaryFormat format);
+
+
+/* binarize_packed straight from a PPM file: rows are thresholded as they
+ * are read, a few megabytes at a time, so the image is never held in
+ * memory as a whole; returns as binarize_packed, or -2 if the input
+ * isn't a valid PPM or ends early
+ */
+int binarize_stream(FILE * img_file, FILE * new_img, float thrshld,
+                    BinaryFormat format);
+
+
 //______crop___
 /* crop the image given two corner pixel locations
  */
@@ -39,12 +134,42 @@ int crop(Image * img1, FILE * new_image, int upper_col, int upper_row,
 int zoom_in(Image * img1, FILE * new_image);
 
 
+//_____zoom___
+/* "zoom in" an image by an integer factor, duplicating each pixel into a
+ * factor x factor square of pixels
+ */
+int zoom(Image * img1, FILE * new_image, int factor);
+
+
 //___rotate_left___
 /* rotate the image 90 degrees to the left (counter-clockwise)
  */
 int rotate_left(Image * img1, FILE * new_image);
 
 
+//___rotate___
+/* rotate the image by any angle, in degrees counter-clockwise, about its
+ * center; the image keeps its size, so the rotated image's corners are
+ * cropped off, and corners rotated in from outside it are black.
+ * Multiples of 90 degrees are done losslessly and, like rotate_left,
+ * swap the dimensions for odd quarter turns; so the output's shape jumps
+ * there (a W x H image rotated by 89 or 91 degrees is still W x H, but by
+ * 90 it is H x W)
+ */
+int rotate(Image * img1, FILE * new_image, float degrees,
+           Interpolation interp);
+
+
+//___affine___
+/* transform the image by the affine map taking input pixel (x, y) (column,
+ * row) to (m[0] x + m[1] y + m[2], m[3] x + m[4] y + m[5]); the image keeps
+ * its size, and parts mapped in from outside it are black. Returns -1 if
+ * the map isn't invertible
+ */
+int affine(Image * img1, FILE * new_image, const double m[6],
+           Interpolation interp);
+
+
 //___pointillism___
 /* apply painting-like pointillism technique to image
  */
@@ -57,4 +182,144 @@ int pointillism(Image * img1, FILE * new_image);
 int blur(Image * img1, FILE * new_image, float sigma);
 
 
+
+//___convolution engine___
+/* allocate a zeroed width x height kernel; returns NULL unless both
+ * dimensions are positive, odd and at most CONV_MAX_SIZE */
+ConvKernel * make_conv_kernel(int width, int height);
+
+
+/* free a kernel and set the pointer to NULL */
+void free_conv_kernel(ConvKernel **k);
+
+
+/* read a kernel from a text file: "<width> <height>" followed by
+ * width * height weights in row-major order; returns NULL if malformed */
+ConvKernel * read_conv_kernel(FILE *fp);
+
+
+/* Convolve every channel of the image with the kernel. Separable kernels
+ * are detected and run as two 1D passes. Work is split across threads.
+ * Returns a malloc'd rows x cols x 3 buffer of unclamped float channel
+ * values (r, g, b interleaved), or NULL if out of memory.
+ */
+float * convolve_channels(const Image *img, const ConvKernel *k,
+                          BorderMode border);
+
+
+//___convolve___
+/* convolve the image with an arbitrary kernel, saturating the result
+ */
+int convolve(Image * img1, FILE * new_image, const ConvKernel * k,
+             BorderMode border);
+
+
+//___sharpen___
+/* sharpen the image with a 3x3 laplacian-based kernel
+ */
+int sharpen(Image * img1, FILE * new_image);
+
+
+//___unsharp___
+/* unsharp mask: add back amount times the difference between the image
+ * and a gaussian blur of it; returns -1 if amount is negative or sigma
+ * isn't positive or is over about 170 (the blur would be wider
+ * than CONV_MAX_SIZE)
+ */
+int unsharp(Image * img1, FILE * new_image, float sigma, float amount);
+
+
+//___bilateral___
+/* edge-preserving smoothing: averages over about sigma_s pixels, but only
+ * with pixels within about sigma_r gray levels (both at least 1);
+ * approximated with a bilateral grid, so larger sigma_s is no slower
+ */
+int bilateral(Image * img1, FILE * new_image, float sigma_s, float sigma_r);
+
+
+//___motion_blur___
+/* directional blur: averages each pixel along a line of about length
+ * pixels (at least 1) through it, at angle degrees counter-clockwise from
+ * horizontal; the cost doesn't depend on the length
+ */
+int motion_blur(Image * img1, FILE * new_image, float length, float angle);
+
+
+//___median___
+/* replace each channel of each pixel by its median over the
+ * (2 radius + 1) x (2 radius + 1) window around it (radius 0 to 127);
+ * the cost per pixel doesn't depend on the radius
+ */
+int median(Image * img1, FILE * new_image, int radius);
+
+
+//___sobel___
+/* edge detection: per-channel sobel gradient magnitude
+ */
+int sobel(Image * img1, FILE * new_image);
+
+
+
+//___statistics___
+/* Compute histograms of each channel and of luminance (pixel_to_gray) in
+ * one multithreaded pass, and derive min/max/mean/stddev from them.
+ * Returns 0 on success, -1 if out of memory.
+ */
+int compute_stats(const Image *img, ImageStats *stats);
+
+
+/* Otsu's method: pick the threshold that best splits the luminance
+ * histogram into two classes; returns the value to pass to binarize */
+int otsu_threshold(const ImageStats *stats);
+
+
+//___stats___
+/* write the image's statistics as JSON, including the full histograms
+ * if with_histograms is nonzero
+ */
+int stats(Image * img1, FILE * output, int with_histograms);
+
+
+//___equalize___
+/* histogram-equalize each channel of the image
+ */
+int equalize(Image * img1, FILE * new_image);
+
+
+
+//___comparison___
+/* return 1 if the images have the same size and pixels, else 0;
+ * stops at the first difference */
+int images_equal(const Image *a, const Image *b);
+
+
+/* Compute PSNR, MSE, max difference and number of differing pixels of
+ * two same-sized images, multithreaded (and SIMD where available). If
+ * mask is not NULL it must be the same size, and each of its pixels is
+ * set white where the images differ and black where they match.
+ * Returns 0 on success, -1 if the sizes don't match, -2 if out of memory.
+ */
+int diff_images(const Image *a, const Image *b, ImageDiff *diff,
+                Image *mask);
+
+
+/* 64-bit perceptual difference hash (dHash): the image is shrunk to
+ * 9x8 grayscale and each bit records whether a cell is brighter than its
+ * right neighbour; similar images give hashes a small Hamming distance
+ * apart */
+uint64_t image_dhash(const Image *img);
+
+
+/* number of bits that differ between two hashes */
+int hash_distance(uint64_t a, uint64_t b);
+
+
+//___compare___
+/* write a mask of the pixels where img1 and img2 differ, and print
+ * PSNR, max difference and perceptual hash distance to stdout; returns
+ * -1 if the sizes don't match, -2 if out of memory
+ */
+int compare(Image * img1, FILE * new_image, Image * img2);
+
+
 #endif
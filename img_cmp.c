@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ppm_io.h"
+#include "image_manip.h"
+
+
+/* Image comparison tool.
+ *
+ *   ./img_cmp <image1> <image2> [<mask-image>]
+ *       print PSNR, max difference and perceptual hash distance, and
+ *       optionally write a mask of the differing pixels
+ *   ./img_cmp -q <image1> <image2>
+ *       only check whether the images are identical
+ *   ./img_cmp -hash <image>...
+ *       print the perceptual hash of each image
+ *   ./img_cmp -dupes <max-distance> <image>...
+ *       list pairs of images whose hashes are at most max-distance
+ *       bits apart
+ *
+ * Exits 0 if the images are identical (or, for -hash and -dupes, on
+ * success), 1 if they differ or duplicates were found, 2 on error.
+ */
+
+
+#define CMP_SAME  0
+#define CMP_DIFF  1
+#define CMP_ERROR 2
+
+
+void print_usage();
+
+
+// Reads the named PPM, printing an error and returning NULL on failure
+static Image * load(const char *name) {
+    FILE *fp = fopen(name, "rb");
+    if (!fp) {
+        fprintf(stderr, "Unable to read %s\n", name);
+        return NULL;
+    }
+
+    Image *img = read_ppm(fp);
+    fclose(fp);
+    if (!img) {
+        fprintf(stderr, "%s cannot be read as a ppm\n", name);
+    }
+    return img;
+}
+
+
+// -q: equality only, stopping at the first difference
+static int check_equal(const char *name1, const char *name2) {
+    Image *a = load(name1);
+    Image *b = a ? load(name2) : NULL;
+    if (!a || !b) {
+        if (a) {
+            free_image(&a);
+        }
+        return CMP_ERROR;
+    }
+
+    int equal = images_equal(a, b);
+    free_image(&a);
+    free_image(&b);
+
+    return equal ? CMP_SAME : CMP_DIFF;
+}
+
+
+// Full comparison, optionally writing a mask of differing pixels
+static int full_compare(const char *name1, const char *name2,
+                        const char *mask_name) {
+    Image *a = load(name1);
+    Image *b = a ? load(name2) : NULL;
+    if (!a || !b) {
+        if (a) {
+            free_image(&a);
+        }
+        return CMP_ERROR;
+    }
+
+    if (a->rows != b->rows || a->cols != b->cols) {
+        printf("size: %d x %d vs %d x %d\n", a->cols, a->rows, b->cols,
+               b->rows);
+        free_image(&a);
+        free_image(&b);
+        return CMP_DIFF;
+    }
+
+    Image *mask = mask_name ? make_image(a->rows, a->cols) : NULL;
+    ImageDiff diff;
+    if ((mask_name && !mask) || diff_images(a, b, &diff, mask) != 0) {
+        fprintf(stderr, "Out of memory\n");
+        free_image(&mask);
+        free_image(&a);
+        free_image(&b);
+        return CMP_ERROR;
+    }
+
+    printf("psnr: %.4f dB\n", diff.psnr);
+    printf("mse: %.4f\n", diff.mse);
+    printf("max diff: %d\n", diff.max_diff);
+    printf("differing pixels: %lld\n", diff.differing);
+    printf("hash distance: %d\n",
+           hash_distance(image_dhash(a), image_dhash(b)));
+
+    int rc = diff.max_diff == 0 ? CMP_SAME : CMP_DIFF;
+    if (mask) {
+        FILE *fp = fopen(mask_name, "wb");
+        if (!fp || write_ppm(fp, mask) == 0) {
+            fprintf(stderr, "Could not write %s\n", mask_name);
+            rc = CMP_ERROR;
+        }
+        if (fp) {
+            fclose(fp);
+        }
+        free_image(&mask);
+    }
+
+    free_image(&a);
+    free_image(&b);
+    return rc;
+}
+
+
+// Hashes each named image into hashes; unreadable images are reported
+// and marked invalid
+static void hash_all(int count, char *names[], uint64_t *hashes,
+                     int *valid) {
+    for (int i = 0; i < count; i++) {
+        Image *img = load(names[i]);
+        valid[i] = img != NULL;
+        if (img) {
+            hashes[i] = image_dhash(img);
+            free_image(&img);
+        }
+    }
+}
+
+
+// -hash and -dupes
+static int index_images(int count, char *names[], int max_distance,
+                        int dupes) {
+    uint64_t *hashes = malloc(sizeof(uint64_t) * count);
+    int *valid = malloc(sizeof(int) * count);
+    if (!hashes || !valid) {
+        free(hashes);
+        free(valid);
+        return CMP_ERROR;
+    }
+
+    // Only the hashes are kept, so memory doesn't grow with image size
+    hash_all(count, names, hashes, valid);
+
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        if (!valid[i]) {
+            continue;
+        }
+        if (!dupes) {
+            printf("%016llx %s\n", (unsigned long long) hashes[i], names[i]);
+            continue;
+        }
+
+        // A 64-bit XOR and popcount per pair is cheap enough to check
+        // every pair of thousands of images
+        for (int j = i + 1; j < count; j++) {
+            int distance = valid[j] ? hash_distance(hashes[i], hashes[j]) : 65;
+            if (distance <= max_distance) {
+                printf("%d %s %s\n", distance, names[i], names[j]);
+                found = 1;
+            }
+        }
+    }
+
+    free(hashes);
+    free(valid);
+    return dupes && found ? CMP_DIFF : CMP_SAME;
+}
+
+
+int main(int argc, char *argv[]) {
+    if (argc >= 4 && strcmp(argv[1], "-q") == 0) {
+        return check_equal(argv[2], argv[3]);
+    }
+    if (argc >= 3 && strcmp(argv[1], "-hash") == 0) {
+        return index_images(argc - 2, argv + 2, 0, 0);
+    }
+    if (argc >= 4 && strcmp(argv[1], "-dupes") == 0) {
+        return index_images(argc - 3, argv + 3, atoi(argv[2]), 1);
+    }
+    if ((argc == 3 || argc == 4) && argv[1][0] != '-') {
+        return full_compare(argv[1], argv[2], argc == 4 ? argv[3] : NULL);
+    }
+
+    print_usage();
+    return CMP_ERROR;
+}
+
+
+void print_usage() {
+    printf("USAGE: ./img_cmp <image1> <image2> [<mask-image>]\n");
+    printf("       ./img_cmp -q <image1> <image2>\n");
+    printf("       ./img_cmp -hash <image>...\n");
+    printf("       ./img_cmp -dupes <max-distance> <image>...\n");
+}
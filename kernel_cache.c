@@ -0,0 +1,255 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include "kernel_cache.h"
+#include "image_manip.h"
+
+
+/* Cached kernels are kept on a list in most-recently-used order. The list,
+ * the reference counts and the counters are guarded by one mutex, which is
+ * only held for the lookup itself; kernels are never modified once built,
+ * so any number of threads can read the weights at the same time.
+ */
+typedef struct _entry {
+    Kernel kernel;
+    int refs;
+    int cached;            // 0 once evicted/cleared while still in use
+    struct _entry *next;
+} Entry;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static Entry *head = NULL;
+static size_t cache_bytes = 0;
+static size_t unused_bytes = 0;     // part of cache_bytes with refs == 0
+static size_t cache_limit = 64u << 20;
+static unsigned long hits = 0;
+static unsigned long misses = 0;
+static unsigned long evictions = 0;
+
+
+
+// Frees a kernel entry and all of its tables
+static void free_entry(Entry *e) {
+    free(e->kernel.weights2d);
+    free(e->kernel.weights1d);
+    free(e);
+}
+
+
+
+int kernel_width(float sigma, KernelPrecision precision) {
+    // Checked as a double first, since converting a float too big for an
+    // int is undefined
+    double width = (precision == KERNEL_FAST ? 6 : 10) * (double) sigma;
+    if (!(sigma > 0) || !(width < KERNEL_MAX_WIDTH)) {
+        return -1;
+    }
+
+    // Window width, forced odd so there's a center tap
+    int n = width;
+    if (n%2 == 0) {
+        n++;
+    }
+    return n;
+}
+
+
+
+// Builds the tables for a kernel n taps wide; returns NULL if out of memory
+static Entry * build_entry(float sigma, KernelPrecision precision, int n) {
+    Entry *e = calloc(1, sizeof(Entry));
+    if (!e) {
+        return NULL;
+    }
+
+    Kernel *k = &e->kernel;
+    k->sigma = sigma;
+    k->precision = precision;
+    k->n = n;
+    k->radius = n/2;
+
+    // Sizes are worked out in size_t; n is at most KERNEL_MAX_WIDTH, so
+    // the n x n table's byte count can't overflow
+    size_t count2d = (size_t) n * n;
+    k->weights2d = malloc(sizeof(double) * count2d);
+    k->weights1d = malloc(sizeof(double) * n);
+    if (!k->weights2d || !k->weights1d) {
+        free_entry(e);
+        return NULL;
+    }
+    k->bytes = sizeof(Entry) + sizeof(double) * (count2d + n);
+
+    // 2D table, computed exactly as blur always has so results don't shift
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            int dx = abs(k->radius - i);
+            int dy = abs(k->radius - j);
+            k->weights2d[(size_t) i * n + j] = (1.0 / (2.0 * PI * sq(sigma)))
+                    * exp( -(sq(dx) + sq(dy)) / (2 * sq(sigma)));
+        }
+    }
+    k->total = 0;
+    for (size_t i = 0; i < count2d; i++) {
+        k->total += k->weights2d[i];
+    }
+
+    // Normalized 1D weights for separable use
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        int d = i - k->radius;
+        k->weights1d[i] = exp(-sq(d) / (2.0 * sq(sigma)));
+        sum += k->weights1d[i];
+    }
+    for (int i = 0; i < n; i++) {
+        k->weights1d[i] /= sum;
+    }
+
+    return e;
+}
+
+
+
+// Evicts unused kernels, oldest first, until they fit in the limit;
+// must hold lock
+static void trim_cache(void) {
+    while (unused_bytes > cache_limit) {
+        Entry **victim = NULL;
+        for (Entry **p = &head; *p; p = &(*p)->next) {
+            if ((*p)->refs == 0) {
+                victim = p;
+            }
+        }
+        if (!victim) {
+            return;
+        }
+
+        Entry *e = *victim;
+        *victim = e->next;
+        cache_bytes -= e->kernel.bytes;
+        unused_bytes -= e->kernel.bytes;
+        evictions++;
+        free_entry(e);
+    }
+}
+
+
+
+const Kernel * kernel_acquire(float sigma, KernelPrecision precision) {
+    int n = kernel_width(sigma, precision);
+    if (n < 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    for (Entry **p = &head; *p; p = &(*p)->next) {
+        Entry *e = *p;
+        if (e->kernel.sigma == sigma && e->kernel.precision == precision) {
+            // Move to front of the list
+            *p = e->next;
+            e->next = head;
+            head = e;
+
+            if (e->refs++ == 0) {
+                unused_bytes -= e->kernel.bytes;
+            }
+            hits++;
+            pthread_mutex_unlock(&lock);
+            return &e->kernel;
+        }
+    }
+    misses++;
+    pthread_mutex_unlock(&lock);
+
+    // Built outside the lock so other lookups aren't held up; if another
+    // thread builds the same kernel meanwhile, both copies are valid
+    Entry *e = build_entry(sigma, precision, n);
+    if (!e) {
+        return NULL;
+    }
+    e->refs = 1;
+
+    // In use, so it doesn't count against the limit until it's released
+    pthread_mutex_lock(&lock);
+    if (e->kernel.bytes <= cache_limit) {
+        e->cached = 1;
+        e->next = head;
+        head = e;
+        cache_bytes += e->kernel.bytes;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return &e->kernel;
+}
+
+
+
+void kernel_release(const Kernel *k) {
+    if (!k) {
+        return;
+    }
+
+    // The kernel is the first member of its entry
+    Entry *e = (Entry *) k;
+
+    pthread_mutex_lock(&lock);
+    e->refs--;
+    int orphan = (e->refs == 0 && !e->cached);
+    if (e->refs == 0 && e->cached) {
+        unused_bytes += e->kernel.bytes;
+        trim_cache();
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (orphan) {
+        free_entry(e);
+    }
+}
+
+
+
+void kernel_cache_set_limit(size_t bytes) {
+    pthread_mutex_lock(&lock);
+    cache_limit = bytes;
+    trim_cache();
+    pthread_mutex_unlock(&lock);
+}
+
+
+
+void kernel_cache_clear(void) {
+    pthread_mutex_lock(&lock);
+    Entry **p = &head;
+    while (*p) {
+        Entry *e = *p;
+        *p = e->next;
+        cache_bytes -= e->kernel.bytes;
+        if (e->refs == 0) {
+            unused_bytes -= e->kernel.bytes;
+            free_entry(e);
+        } else {
+            // Still in use: freed by its last kernel_release
+            e->cached = 0;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+
+
+void kernel_cache_stats(KernelCacheStats *stats) {
+    pthread_mutex_lock(&lock);
+    stats->hits = hits;
+    stats->misses = misses;
+    stats->evictions = evictions;
+    stats->entries = 0;
+    for (Entry *e = head; e; e = e->next) {
+        stats->entries++;
+    }
+    stats->bytes = cache_bytes;
+    stats->unused_bytes = unused_bytes;
+    stats->limit = cache_limit;
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,79 @@
+#ifndef KERNEL_CACHE_H
+#define KERNEL_CACHE_H
+#include <stddef.h>
+
+/* How far out a gaussian kernel is sampled:
+ * KERNEL_EXACT uses a window of 10*sigma taps (+/- 5 sigma), as blur
+ * always has; KERNEL_FAST cuts it to 6*sigma taps (+/- 3 sigma), which
+ * still covers 99.7% of the weight
+ */
+typedef enum _kernel_precision {
+    KERNEL_EXACT,
+    KERNEL_FAST
+} KernelPrecision;
+
+/* struct to store a gaussian kernel; shared between callers, so
+ * everything in it is read-only once it has been handed out */
+typedef struct _kernel {
+    float sigma;
+    KernelPrecision precision;
+    int n;                 // window width in taps (always odd)
+    int radius;            // n / 2
+    double *weights2d;     // n x n unnormalized table, row-major
+    double total;          // sum of weights2d, added up in row-major order
+    double *weights1d;     // n weights, normalized to sum to 1
+    size_t bytes;          // memory held by the kernel
+} Kernel;
+
+/* cache counters, for monitoring */
+typedef struct _kernel_cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    size_t entries;
+    size_t bytes;          // held by all cached kernels
+    size_t unused_bytes;   // held by cached kernels nobody has acquired
+    size_t limit;
+} KernelCacheStats;
+
+
+// widest kernel, so that indexes into its n x n table fit in an int
+#define KERNEL_MAX_WIDTH 46339
+
+
+/* window width in taps of the kernel for sigma at the given precision,
+ * or -1 if sigma is not positive or the width would be over
+ * KERNEL_MAX_WIDTH */
+int kernel_width(float sigma, KernelPrecision precision);
+
+
+/* Look up (building it on a miss) the kernel for sigma at the given
+ * precision. Every successful call must be paired with kernel_release.
+ * Safe to call from several threads at once.
+ * Returns NULL if kernel_width rejects sigma or memory runs out.
+ */
+const Kernel * kernel_acquire(float sigma, KernelPrecision precision);
+
+
+/* hand back a kernel obtained from kernel_acquire */
+void kernel_release(const Kernel *k);
+
+
+/* Bound the memory held by unused cached kernels (default 64 MB);
+ * least recently used kernels are evicted first. Kernels that are in use
+ * don't count against the limit and are never evicted. A kernel bigger
+ * than the limit is still built but is freed as soon as it is released.
+ */
+void kernel_cache_set_limit(size_t bytes);
+
+
+/* empty the cache: kernels not in use are freed now, ones still in use
+ * when they are released; matches atexit's signature */
+void kernel_cache_clear(void);
+
+
+/* copy the cache's hit/miss counters and current size into stats */
+void kernel_cache_stats(KernelCacheStats *stats);
+
+
+#endif
@@ -0,0 +1,242 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include "kernel_cache.h"
+
+
+/* Unit tests for the gaussian kernel cache: hits and misses, least
+ * recently used eviction under a small limit, releasing kernels after the
+ * cache has been cleared, and many threads acquiring at once.
+ * USAGE: ./kernel_cache_test
+ * Prints each failure and exits nonzero if there were any.
+ */
+
+
+// Threads and acquires per thread for the concurrent test
+#define THREADS 8
+#define ROUNDS 2000
+
+static int failures = 0;
+
+
+// Records a failed check
+static void check(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+
+// Current counters
+static KernelCacheStats stats(void) {
+    KernelCacheStats s;
+    kernel_cache_stats(&s);
+    return s;
+}
+
+
+// Checks a kernel's tables look right for its sigma
+static int kernel_ok(const Kernel *k, float sigma, KernelPrecision precision) {
+    if (!k || k->sigma != sigma || k->precision != precision ||
+            k->n != kernel_width(sigma, precision) || k->radius != k->n / 2) {
+        return 0;
+    }
+    double sum = 0;
+    for (int i = 0; i < k->n; i++) {
+        sum += k->weights1d[i];
+    }
+    return fabs(sum - 1) < 1e-9 && k->total > 0 &&
+           k->weights1d[k->radius] >= k->weights1d[0];
+}
+
+
+static void test_width(void) {
+    check(kernel_width(1, KERNEL_EXACT) == 11, "width of sigma 1 exact");
+    check(kernel_width(1, KERNEL_FAST) == 7, "width of sigma 1 fast");
+    check(kernel_width(0.05f, KERNEL_EXACT) == 1, "width of a tiny sigma");
+    check(kernel_width(0, KERNEL_EXACT) == -1, "width of sigma 0");
+    check(kernel_width(-1, KERNEL_EXACT) == -1, "width of a negative sigma");
+    check(kernel_width(NAN, KERNEL_EXACT) == -1, "width of NaN");
+    check(kernel_width(1e30f, KERNEL_FAST) == -1, "width of a huge sigma");
+    check(kernel_width(KERNEL_MAX_WIDTH / 10.0f + 1, KERNEL_EXACT) == -1,
+          "width just over the maximum");
+    check(kernel_acquire(-1, KERNEL_EXACT) == NULL, "acquire a bad sigma");
+}
+
+
+static void test_hits(void) {
+    kernel_cache_clear();
+    KernelCacheStats before = stats();
+
+    const Kernel *a = kernel_acquire(1.5f, KERNEL_EXACT);
+    const Kernel *b = kernel_acquire(1.5f, KERNEL_EXACT);
+    const Kernel *c = kernel_acquire(1.5f, KERNEL_FAST);
+    check(kernel_ok(a, 1.5f, KERNEL_EXACT), "exact kernel tables");
+    check(kernel_ok(c, 1.5f, KERNEL_FAST), "fast kernel tables");
+    check(a == b, "second acquire shares the kernel");
+    check(a != c, "precisions are cached separately");
+
+    KernelCacheStats after = stats();
+    check(after.hits - before.hits == 1, "one hit");
+    check(after.misses - before.misses == 2, "two misses");
+    check(after.entries == 2, "two entries");
+    check(after.bytes == a->bytes + c->bytes, "bytes of the entries");
+    check(after.unused_bytes == 0, "no unused bytes while in use");
+
+    kernel_release(a);
+    check(stats().unused_bytes == 0, "still in use after one release");
+    kernel_release(b);
+    kernel_release(c);
+    check(stats().unused_bytes == stats().bytes, "all unused once released");
+}
+
+
+static void test_eviction(void) {
+    kernel_cache_clear();
+
+    // Room for two unused kernels of this size
+    const Kernel *k = kernel_acquire(2, KERNEL_EXACT);
+    size_t size = k->bytes;
+    kernel_release(k);
+    kernel_cache_clear();
+    kernel_cache_set_limit(2 * size);
+    KernelCacheStats before = stats();
+
+    // Nearby sigmas give the same width, so the same size
+    float a = 2, b = 2.01f, c = 2.02f;
+    kernel_release(kernel_acquire(a, KERNEL_EXACT));
+    kernel_release(kernel_acquire(b, KERNEL_EXACT));
+    kernel_release(kernel_acquire(a, KERNEL_EXACT));
+    kernel_release(kernel_acquire(c, KERNEL_EXACT));
+
+    // b was least recently used, so went when c came in
+    KernelCacheStats after = stats();
+    check(after.evictions - before.evictions == 1, "one eviction");
+    check(after.entries == 2, "two entries kept");
+    check(after.unused_bytes <= after.limit, "unused bytes within limit");
+    kernel_release(kernel_acquire(a, KERNEL_EXACT));
+    kernel_release(kernel_acquire(c, KERNEL_EXACT));
+    check(stats().misses == after.misses, "a and c still cached");
+    kernel_release(kernel_acquire(b, KERNEL_EXACT));
+    check(stats().misses == after.misses + 1, "b was evicted");
+
+    // Kernels in use don't count against the limit, and aren't evicted
+    kernel_cache_clear();
+    kernel_cache_set_limit(size);
+    const Kernel *held[3];
+    held[0] = kernel_acquire(a, KERNEL_EXACT);
+    held[1] = kernel_acquire(b, KERNEL_EXACT);
+    held[2] = kernel_acquire(c, KERNEL_EXACT);
+    check(stats().entries == 3, "in-use kernels over the limit are kept");
+    for (int i = 0; i < 3; i++) {
+        check(kernel_ok(held[i], held[i]->sigma, KERNEL_EXACT),
+              "in-use kernel still valid");
+        kernel_release(held[i]);
+    }
+    check(stats().entries == 1 && stats().unused_bytes <= size,
+          "released kernels trimmed to the limit");
+
+    // A kernel bigger than the limit is built but not kept
+    const Kernel *big = kernel_acquire(3, KERNEL_EXACT);
+    check(kernel_ok(big, 3, KERNEL_EXACT), "kernel over the limit is built");
+    kernel_release(big);
+    check(stats().bytes <= size, "kernel over the limit not cached");
+
+    kernel_cache_set_limit(64u << 20);
+}
+
+
+static void test_clear(void) {
+    kernel_cache_clear();
+    const Kernel *k = kernel_acquire(4, KERNEL_FAST);
+    kernel_cache_clear();
+
+    // Still usable until released; the sanitizers catch a use after free
+    KernelCacheStats s = stats();
+    check(s.entries == 0 && s.bytes == 0 && s.unused_bytes == 0,
+          "clear empties the cache");
+    check(kernel_ok(k, 4, KERNEL_FAST), "kernel usable after clear");
+
+    const Kernel *k2 = kernel_acquire(4, KERNEL_FAST);
+    check(k2 != k, "clear means a new kernel is built");
+    kernel_release(k);
+    kernel_release(k2);
+    check(stats().entries == 1, "only the new kernel is cached");
+    kernel_release(NULL);
+}
+
+
+// Acquires and checks kernels for a handful of sigmas, over and over
+static void * hammer(void *arg) {
+    unsigned seed = *(unsigned *) arg;
+    int bad = 0;
+    for (int i = 0; i < ROUNDS; i++) {
+        seed = seed * 1103515245u + 12345u;
+        float sigma = 0.5f + (seed >> 16) % 6 * 0.5f;
+        KernelPrecision precision = (seed >> 8) & 1 ? KERNEL_EXACT : KERNEL_FAST;
+        const Kernel *k = kernel_acquire(sigma, precision);
+        bad += !kernel_ok(k, sigma, precision);
+        kernel_release(k);
+    }
+    *(unsigned *) arg = bad;
+    return NULL;
+}
+
+
+static void test_threads(void) {
+    kernel_cache_clear();
+
+    // Small enough that kernels are evicted while others are in use
+    const Kernel *k = kernel_acquire(2, KERNEL_EXACT);
+    kernel_cache_set_limit(2 * k->bytes);
+    kernel_release(k);
+    KernelCacheStats before = stats();
+
+    pthread_t threads[THREADS];
+    unsigned args[THREADS];
+    int started = 0;
+    for (int t = 0; t < THREADS; t++) {
+        args[t] = t + 1;
+        if (pthread_create(&threads[t], NULL, hammer, &args[t]) == 0) {
+            started++;
+        } else {
+            break;
+        }
+    }
+    int bad = 0;
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+        bad += args[t];
+    }
+    check(started == THREADS, "threads started");
+    check(bad == 0, "kernels valid under concurrent acquire");
+
+    KernelCacheStats after = stats();
+    check((after.hits - before.hits) + (after.misses - before.misses) ==
+          (unsigned long) started * ROUNDS, "every acquire counted");
+    check(after.unused_bytes == after.bytes, "nothing left in use");
+    check(after.unused_bytes <= after.limit, "unused bytes within limit");
+
+    kernel_cache_set_limit(64u << 20);
+}
+
+
+int main(void) {
+    test_width();
+    test_hits();
+    test_eviction();
+    test_clear();
+    test_threads();
+    kernel_cache_clear();
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all kernel cache tests passed\n");
+    return 0;
+}
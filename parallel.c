@@ -0,0 +1,88 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "parallel.h"
+
+// Upper bound on worker threads, however many CPUs are reported
+#define MAX_THREADS 64
+
+
+/* struct to store one worker's share of a parallel_for */
+typedef struct _chunk {
+    void (*fn)(void *ctx, int begin, int end, int thread);
+    void *ctx;
+    int begin;
+    int end;
+    int thread;
+} Chunk;
+
+
+
+int parallel_threads(void) {
+    const char *env = getenv("PHOTO_THREADS");
+    int threads = env ? atoi(env) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > MAX_THREADS) {
+        threads = MAX_THREADS;
+    }
+    return threads;
+}
+
+
+
+// Thread entry point: runs one chunk
+static void * run_chunk(void *arg) {
+    Chunk *c = arg;
+    c->fn(c->ctx, c->begin, c->end, c->thread);
+    return NULL;
+}
+
+
+
+void parallel_for(int count, void (*fn)(void *ctx, int begin, int end,
+                                        int thread), void *ctx) {
+    if (count <= 0) {
+        return;
+    }
+
+    int threads = parallel_threads();
+    if (threads > count) {
+        threads = count;
+    }
+    if (threads == 1) {
+        fn(ctx, 0, count, 0);
+        return;
+    }
+
+    Chunk chunks[MAX_THREADS];
+    pthread_t ids[MAX_THREADS];
+    int started[MAX_THREADS];
+
+    // Chunk t covers [t*count/threads, (t+1)*count/threads)
+    for (int t = 0; t < threads; t++) {
+        chunks[t].fn = fn;
+        chunks[t].ctx = ctx;
+        chunks[t].begin = (int) ((long long) count * t / threads);
+        chunks[t].end = (int) ((long long) count * (t + 1) / threads);
+        chunks[t].thread = t;
+    }
+
+    // Chunk 0 runs on the calling thread; any chunk whose thread fails
+    // to start runs there too
+    for (int t = 1; t < threads; t++) {
+        started[t] = pthread_create(&ids[t], NULL, run_chunk, &chunks[t]) == 0;
+    }
+    run_chunk(&chunks[0]);
+    for (int t = 1; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(ids[t], NULL);
+        } else {
+            run_chunk(&chunks[t]);
+        }
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+
+/* number of worker threads operations should use: the PHOTO_THREADS
+ * environment variable if set, otherwise the number of online CPUs */
+int parallel_threads(void);
+
+
+/* Split the range [0, count) into contiguous chunks, one per worker
+ * thread, and call fn(ctx, begin, end, thread) on each; thread runs from
+ * 0 to the number of chunks - 1. Returns once every chunk is done.
+ * Falls back to running everything on the calling thread if threads
+ * can't be started.
+ */
+void parallel_for(int count, void (*fn)(void *ctx, int begin, int end,
+                                        int thread), void *ctx);
+
+
+#endif
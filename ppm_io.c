@@ -1,90 +1,171 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <assert.h>
 #include <ctype.h>
+#include <unistd.h>
 #include "ppm_io.h"
 
 
 
+size_t image_bytes(int rows, int cols) {
+    if (rows <= 0 || cols <= 0) {
+        return 0;
+    }
+
+    // Keeps the byte count within what pointer arithmetic can span
+    if ((size_t) rows > PTRDIFF_MAX / sizeof(Pixel) / (size_t) cols) {
+        return 0;
+    }
+
+    return (size_t) rows * cols * sizeof(Pixel);
+}
+
+
+
+/* helper function for read_ppm: returns the machine's physical memory in
+ * bytes, or 0 if it can't be determined
+ */
+static size_t physical_memory(void) {
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && page_size > 0 &&
+        (size_t) pages <= SIZE_MAX / (size_t) page_size) {
+        return (size_t) pages * page_size;
+    }
+#endif
+    return 0;
+}
+
+
+
 /* helper function for read_ppm, takes a filehandle
- * and reads a number, but detects and skips comment lines
+ * and reads a number, but detects and skips comment lines;
+ * leaves the whitespace after the number unread (after the last header
+ * number, exactly one whitespace character comes before the pixels,
+ * which may themselves look like whitespace), and saturates numbers too
+ * big for an int at INT_MAX
  */
 int read_num(FILE *fp) {
     assert(fp);
 
     int ch;
-    // # marks a comment line 
-    while((ch = fgetc(fp)) == '#') { 
-      // Discard characters til end of line
-        while( ((ch = fgetc(fp)) != '\n') && ch != EOF ) {
+    // Skips whitespace, and # comment lines
+    while ((ch = fgetc(fp)) != EOF) {
+        if (ch == '#') {
+            // Discard characters til end of line
+            while( ((ch = fgetc(fp)) != '\n') && ch != EOF ) {
+            }
+        } else if (!isspace(ch)) {
+            break;
         }
     }
-    // Put back the last thing we found                                                                                                                                         
-    ungetc(ch, fp);
 
-    int val;
-    // Try to get an int 
-    if (fscanf(fp, "%d", &val) == 1) { 
-        // Drop trailing whitespace 
-        while(isspace(ch = fgetc(fp))) {
-        }
-        ungetc(ch, fp);
-	// We got a value, so return it 
-        return val; 
-    } else {
+    // Read the digits
+    if (!isdigit(ch)) {
         fprintf(stderr, "Error:ppm_io - failed to read number from file\n");
         return -1;
     }
-}
+    int val = 0;
+    while (isdigit(ch)) {
+        int digit = ch - '0';
+        val = val > (INT_MAX - digit) / 10 ? INT_MAX : val * 10 + digit;
+        ch = fgetc(fp);
+    }
 
+    // Put back the last thing we found
+    ungetc(ch, fp);
+    return val;
+}
 
 
 
-Image * read_ppm(FILE *fp) {
+int read_ppm_header(FILE *fp, int *rows, int *cols) {
 
     /* Confirm that we received a good file handle */
     assert(fp != NULL);
 
-    /* Allocate image (but not space to hold pixels -- yet) */
-    Image *im = malloc(sizeof(Image));
-    if (!im) {
-        fprintf(stderr, "Error:ppm_io - failed to allocate memory for image!\n");
-        return NULL;
-    }
-
-    /* Initialize fields to error codes, in case we have to bail out early */
-    im->rows = im->cols = -1;
-
     /* Read in tag; fail if not P6 */
-    char tag[20];
-    tag[19]='\0';
-    fscanf(fp, "%19s\n", tag);
+    char tag[20] = "";
+    if (fscanf(fp, "%19s", tag) != 1) {
+        tag[0] = '\0';
+    }
     if (strncmp(tag, "P6", 20)) {
         fprintf(stderr, "Error:ppm_io - not a PPM (bad tag)\n");
-        free(im);
-        return NULL;
+        return -1;
     }
 
 
     /* Read image dimensions */
 
     // Read in columns
-    im->cols = read_num(fp); // NOTE: cols, then rows (i.e. X size followed by Y size)
+    *cols = read_num(fp); // NOTE: cols, then rows (i.e. X size followed by Y size)
     // Read in rows
-    im->rows = read_num(fp);
+    *rows = read_num(fp);
 
     // Read in colors; fail if not 255
     int colors = read_num(fp);
     if (colors != 255) {
         fprintf(stderr, "Error:ppm_io - PPM file with colors different from 255\n");
-        free(im);
-        return NULL;
+        return -1;
+    }
+
+    // A single whitespace character separates the header from the pixels
+    if (!isspace(fgetc(fp))) {
+        fprintf(stderr, "Error:ppm_io - PPM header not followed by whitespace\n");
+        return -1;
     }
 
     // Confirm that dimensions are positive
-    if (im->cols <= 0 || im->rows <= 0) {
+    if (*cols <= 0 || *rows <= 0) {
         fprintf(stderr, "Error:ppm_io - PPM file with non-positive dimensions\n");
+        return -1;
+    }
+
+    // Confirm that the pixels can be addressed
+    if (image_bytes(*rows, *cols) == 0) {
+        fprintf(stderr, "Error:ppm_io - PPM file dimensions too large\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+size_t read_ppm_pixels(FILE *fp, Pixel *pixels, size_t count) {
+    return fread(pixels, sizeof(Pixel), count, fp);
+}
+
+
+
+Image * read_ppm(FILE *fp) {
+
+    /* Allocate image (but not space to hold pixels -- yet) */
+    Image *im = malloc(sizeof(Image));
+    if (!im) {
+        fprintf(stderr, "Error:ppm_io - failed to allocate memory for image!\n");
+        return NULL;
+    }
+
+    /* Read in the header */
+    if (read_ppm_header(fp, &im->rows, &im->cols) != 0) {
+        free(im);
+        return NULL;
+    }
+
+    // Confirm that the pixels would fit in memory (with overcommit,
+    // malloc could succeed and the process be killed partway through
+    // reading instead)
+    size_t bytes = image_bytes(im->rows, im->cols);
+    size_t memory = physical_memory();
+    if (memory != 0 && bytes > memory) {
+        fprintf(stderr, "Error:ppm_io - PPM image larger than available memory\n");
         free(im);
         return NULL;
     }
@@ -92,7 +173,7 @@ Image * read_ppm(FILE *fp) {
     /* Finally, read in Pixels */
 
     /* Allocate the right amount of space for the Pixels */
-    im->data = malloc(sizeof(Pixel) * (im->rows) * (im->cols));
+    im->data = malloc(bytes);
 
     if (!im->data) {
         fprintf(stderr, "Error:ppm_io - failed to allocate memory for image pixels!\n");
@@ -101,9 +182,9 @@ Image * read_ppm(FILE *fp) {
     }
 
     /* Read in the binary Pixel data */
-    if (fread(im->data, sizeof(Pixel), (im->rows) * (im->cols), fp) !=
-        (size_t)((im->rows) * (im->cols))) {
+    if (fread(im->data, 1, bytes, fp) != bytes) {
         fprintf(stderr, "Error:ppm_io - failed to read data from file!\n");
+        free(im->data);
         free(im);
         return NULL;
     }
@@ -114,26 +195,69 @@ Image * read_ppm(FILE *fp) {
 
 
 
+int write_ppm_header(FILE *fp, int rows, int cols) {
+
+    // Add necesary file info to top of file
+    if (fprintf(fp, "P6\n%d %d\n255\n", cols, rows) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+
+
+int write_pbm_header(FILE *fp, int rows, int cols) {
+    if (fprintf(fp, "P4\n%d %d\n", cols, rows) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+
+
+int write_pgm_header(FILE *fp, int rows, int cols) {
+    if (fprintf(fp, "P5\n%d %d\n255\n", cols, rows) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+
+
+size_t write_ppm_pixels(FILE *fp, const Pixel *pixels, size_t count) {
+    return fwrite(pixels, sizeof(Pixel), count, fp);
+}
+
+
+
 int write_ppm(FILE *fp, const Image *im) {
     int num_rows = im->rows;
     int num_cols = im->cols;
+    size_t count = image_bytes(num_rows, num_cols) / sizeof(Pixel);
 
-    // Add necesary file info to top of file
-    fprintf(fp, "P6\n");
-    fprintf(fp, "%d %d\n", num_cols, num_rows);
-    fprintf(fp, "255\n");
+    if (write_ppm_header(fp, num_rows, num_cols) != 0) {
+        return 0;
+    }
 
     // Write image to disk as PPM
-    return fwrite(im->data, sizeof(Pixel), num_rows*num_cols, fp);
+    if (write_ppm_pixels(fp, im->data, count) != count) {
+        return 0;
+    }
+
+    // Saturates so images with more than INT_MAX pixels still report
+    // success
+    return count > INT_MAX ? INT_MAX : (int) count;
 
 }
 
 
 
 void free_image(Image **im) {
-    free((*im)->data);
-    free(*im);
-    im = NULL;
+    if (*im) {
+        free((*im)->data);
+        free(*im);
+        *im = NULL;
+    }
 }
 
 
@@ -149,8 +273,9 @@ Image * make_image (int rows, int cols) {
     im->rows = rows;
     im->cols = cols;
 
-    // Allocate pixel array
-    im->data = malloc((im->rows * im->cols) * sizeof(Pixel));
+    // Allocate pixel array, failing if the size isn't addressable
+    size_t bytes = image_bytes(rows, cols);
+    im->data = bytes ? malloc(bytes) : NULL;
     if (!im->data) {
         free(im);
         return NULL;
@@ -168,7 +293,7 @@ Image* make_copy (Image *orig) {
 
     // If we got space, copy pixel values
     if (copy) {
-        memcpy(copy->data, orig->data, (copy->rows * copy->cols) * sizeof(Pixel));
+        memcpy(copy->data, orig->data, image_bytes(copy->rows, copy->cols));
     }
 
     return copy;
@@ -184,15 +309,19 @@ void output_dims(Image *im) {
 
 int resize_image(Image **im, int rows, int cols) {
 
-    // Create new dimensions and space for new image
-    (*im)->rows = rows;
-    (*im)->cols = cols;
-    (*im)->data = realloc((*im)->data, sizeof(Pixel) * rows * cols);
+    // Create space for new image; on failure the image is left as it was
+    size_t bytes = image_bytes(rows, cols);
+    Pixel *data = bytes ? realloc((*im)->data, bytes) : NULL;
 
     // Throw error if invalid data
-    if ((*im)->data == NULL) {
+    if (data == NULL) {
         return -1;
     }
 
+    // Set new dimensions
+    (*im)->data = data;
+    (*im)->rows = rows;
+    (*im)->cols = cols;
+
     return 0;
 }
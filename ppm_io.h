@@ -1,6 +1,7 @@
 #ifndef PPM_IO_H
 #define PPM_IO_H
 #include <stdio.h>
+#include <stddef.h>
 
 /* struct to store a point */
 typedef struct _point {
@@ -23,16 +24,65 @@ typedef struct _image {
 } Image;
 
 
-/* read PPM formatted image from a file (assumes fp != NULL) */
+/* pointer to the first pixel of row i; the offset is computed in size_t
+ * so it can't overflow on images with more than INT_MAX pixels */
+#define IMAGE_ROW(img, i) ((img)->data + (size_t) (i) * (img)->cols)
+
+
+/* Size in bytes of the pixels of a rows x cols image; returns 0 if
+ * either dimension isn't positive or the size can't be addressed.
+ */
+size_t image_bytes(int rows, int cols);
+
+
+/* read PPM formatted image from a file (assumes fp != NULL);
+ * rejects images too large to address or to fit in physical memory */
 Image * read_ppm(FILE *fp);
 
 
+/* Read just the header of a PPM file, so the pixels can then be
+ * streamed in a piece at a time with read_ppm_pixels; unlike read_ppm
+ * this doesn't require the image to fit in memory.
+ * Return -1 if it isn't a valid P6 header, otherwise 0.
+ */
+int read_ppm_header(FILE* fp, int* rows, int* cols);
+
+
+/* Read count pixels following a header from read_ppm_header.
+ * Return the number of pixels read.
+ */
+size_t read_ppm_pixels(FILE* fp, Pixel* pixels, size_t count);
+
+
 /* Write given image to disk as a PPM.
- * Return -1 if any failure occurs, otherwise return the number of pixels written.
+ * Return 0 if any failure occurs, otherwise return the number of pixels
+ * written (saturating at INT_MAX).
  */
 int write_ppm(FILE* fp, const Image* img);
 
 
+/* Write just the PPM header for a rows x cols image, so the pixels can
+ * then be streamed out a piece at a time with write_ppm_pixels.
+ * Return -1 if any failure occurs, otherwise 0.
+ */
+int write_ppm_header(FILE* fp, int rows, int cols);
+
+
+/* Write count pixels following a header from write_ppm_header.
+ * Return the number of pixels written.
+ */
+size_t write_ppm_pixels(FILE* fp, const Pixel* pixels, size_t count);
+
+
+/* Write the header of a rows x cols bit-packed black and white (P4)
+ * or 8-bit grayscale (P5) file.
+ * Return -1 if any failure occurs, otherwise 0.
+ */
+int write_pbm_header(FILE* fp, int rows, int cols);
+
+int write_pgm_header(FILE* fp, int rows, int cols);
+
+
 /* utility function to free inner and outer pointers,
  * and set to null 
  */
@@ -40,7 +90,8 @@ void free_image(Image **im);
 
 
 /* allocate a new image of the specified size;
- * doesn't initialize pixel values */
+ * doesn't initialize pixel values; returns NULL if out of memory
+ * or the size isn't addressable */
 Image * make_image(int rows, int cols);
 
 
@@ -52,7 +103,8 @@ Image * make_copy(Image *orig);
 /* output dimensions of the image to stdout */
 void output_dims(Image *orig);
 
-/* resize an image */
+/* resize an image; returns -1 (leaving the image unchanged) if out of
+ * memory or the size isn't addressable, otherwise 0 */
 int resize_image(Image **im, int rows, int cols);
 
 
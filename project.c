@@ -4,6 +4,7 @@
 #include <ctype.h>
 #include "ppm_io.h"
 #include "image_manip.h"
+#include "kernel_cache.h"
 
 
 // Return (exit) codes
@@ -25,8 +26,16 @@ int is_integer(char * str);
 
 int is_float(char * str);
 
+int is_signed_float(char * str);
+
 void free_files(FILE * file1, FILE * file2);
 
+int parse_border(const char * str, BorderMode * border);
+
+int parse_binary_format(const char * str, BinaryFormat * format);
+
+int parse_interpolation(const char * str, Interpolation * interp);
+
 
 
 int main (int argc, char* argv[]) {
@@ -57,6 +66,56 @@ int main (int argc, char* argv[]) {
     }
 
 
+    // PHOTO_IN_PLACE=1 has operations reuse the input image's memory
+    // rather than allocating a second full-size image
+    const char * in_place = getenv("PHOTO_IN_PLACE");
+    use_in_place(in_place && strcmp(in_place, "1") == 0);
+
+    // PHOTO_KERNEL_CACHE_MB bounds the memory kept by unused blur kernels;
+    // the cache is emptied on the way out so leak checkers see it freed
+    char * cache_mb = getenv("PHOTO_KERNEL_CACHE_MB");
+    if (cache_mb && is_integer(cache_mb) && atoi(cache_mb) >= 0) {
+        kernel_cache_set_limit((size_t) atoi(cache_mb) << 20);
+    }
+    atexit(kernel_cache_clear);
+
+
+    // binarize with a fixed threshold to P4 or P5 streams the input
+    // straight through, without reading it into an image first
+    BinaryFormat format;
+    if (argc == 6 && strcmp(argv[3], "binarize") == 0 &&
+            strcmp(argv[4], "auto") != 0 &&
+            parse_binary_format(argv[5], &format) == 1) {
+
+        // Checks binarize parameter is an integer
+        if (!is_integer(argv[4]) && atof(argv[4]) == 0) {
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            return RC_OP_ARGS_RANGE_ERR;
+        }
+
+        int stream_output = binarize_stream(fp1, fp2, atoi(argv[4]), format);
+        free_files(fp1, fp2);
+
+        switch (stream_output) {
+
+        case -2:
+            fprintf(stderr, "Input file cannot be read as a ppm\n");
+            return RC_INVALID_PPM;
+
+        case -1:
+            fprintf(stderr, "Invalid argument for operation\n");
+            return RC_OP_ARGS_RANGE_ERR;
+
+        case 0:
+            fprintf(stderr, "Could not write\n");
+            return RC_WRITE_FAILED;
+        }
+
+        return RC_SUCCESS;
+    }
+
+
     // Tries to make an image object from the input file, and returns error code
     // if fails
     Image * old_img = read_ppm(fp1);
@@ -82,9 +141,13 @@ int main (int argc, char* argv[]) {
         operation = argv[3];
     }
 
-    // Calls binarize
+    // Calls binarize, with an optional output format (default p6)
     if (strcmp(operation, "binarize") == 0) {
-        if (argc != 5) {
+        int packed = 0;
+        if (argc == 6) {
+            packed = parse_binary_format(argv[5], &format);
+        }
+        if ((argc != 5 && argc != 6) || packed < 0) {
             fprintf(stderr, "Incorrect number of arguments passed\n");
             print_usage();
             free_files(fp1, fp2);
@@ -92,16 +155,32 @@ int main (int argc, char* argv[]) {
             return RC_INVALID_OP_ARGS;
         }
 
+        // "auto" picks the threshold with Otsu's method
+        int threshold;
+        if (strcmp(argv[4], "auto") == 0) {
+            ImageStats img_stats;
+            if (compute_stats(old_img, &img_stats) != 0) {
+                fprintf(stderr, "Out of memory\n");
+                free_files(fp1, fp2);
+                free_image(&old_img);
+                return RC_UNSPECIFIED_ERR;
+            }
+            threshold = otsu_threshold(&img_stats);
+        }
+
         // Checks binarize parameter is an integer
-        if (!is_integer(argv[4]) && atof(argv[4]) == 0) {
+        else if (!is_integer(argv[4]) && atof(argv[4]) == 0) {
             fprintf(stderr, "Invalid argument for operation\n");
             free_files(fp1, fp2);
             free_image(&old_img);
             return RC_OP_ARGS_RANGE_ERR;
+        } else {
+            threshold = atoi(argv[4]);
         }
 
-        int threshold = atoi(argv[4]);
-        int binarize_output = binarize(old_img, fp2, threshold);
+        int binarize_output = packed ? binarize_packed(old_img, fp2,
+                                                       threshold, format)
+                                     : binarize(old_img, fp2, threshold);
 
         // Prints possible errors for binarize
         switch (binarize_output) {
@@ -165,9 +244,9 @@ int main (int argc, char* argv[]) {
     }
 
 
-    // Calls zoom_in
+    // Calls zoom_in, with an optional integer zoom factor (default 2)
     else if (strcmp(operation, "zoom_in") == 0) {
-        if (argc != 4) {
+        if (argc != 4 && argc != 5) {
             fprintf(stderr, "Incorrect number of arguments passed\n");
             print_usage();
             free_files(fp1, fp2);
@@ -175,11 +254,31 @@ int main (int argc, char* argv[]) {
             return RC_INVALID_OP_ARGS;
         }
 
-        if (zoom_in(old_img, fp2) == 0) {
+        int factor = 2;
+        if (argc == 5) {
+            if (!is_integer(argv[4])) {
+                fprintf(stderr, "Invalid argument for operation\n");
+                free_files(fp1, fp2);
+                free_image(&old_img);
+                return RC_OP_ARGS_RANGE_ERR;
+            }
+            factor = atoi(argv[4]);
+        }
+
+        int zoom_output = zoom(old_img, fp2, factor);
+
+        switch (zoom_output) {
+
+        case -1:
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+
+        case 0:
             fprintf(stderr, "Could not write\n");
+            free_files(fp1, fp2);
             free_image(&old_img);
-            fclose(fp1);
-            fclose(fp2);
             return RC_WRITE_FAILED;
         }
     }
@@ -262,6 +361,392 @@ int main (int argc, char* argv[]) {
     }
 
 
+    // Calls sobel or sharpen, which take no arguments
+    else if (strcmp(operation, "sobel") == 0 ||
+             strcmp(operation, "sharpen") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Incorrect number of arguments passed\n");
+            print_usage();
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_INVALID_OP_ARGS;
+        }
+
+        int output = strcmp(operation, "sobel") == 0 ? sobel(old_img, fp2)
+                                                     : sharpen(old_img, fp2);
+        if (output == 0) {
+            fprintf(stderr, "Could not write\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_WRITE_FAILED;
+        }
+    }
+
+
+    // Calls unsharp
+    else if (strcmp(operation, "unsharp") == 0) {
+        if (argc != 6) {
+            fprintf(stderr, "Incorrect number of arguments passed\n");
+            print_usage();
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_INVALID_OP_ARGS;
+        }
+
+        if (!is_float(argv[4]) || !is_float(argv[5])) {
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+        }
+
+        float sigma = atof(argv[4]);
+        float amount = atof(argv[5]);
+
+        switch (unsharp(old_img, fp2, sigma, amount)) {
+
+        case -1:
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+
+        case 0:
+            fprintf(stderr, "Could not write\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_WRITE_FAILED;
+        }
+    }
+
+
+    // Calls bilateral
+    else if (strcmp(operation, "bilateral") == 0) {
+        if (argc != 6) {
+            fprintf(stderr, "Incorrect number of arguments passed\n");
+            print_usage();
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_INVALID_OP_ARGS;
+        }
+
+        if (!is_float(argv[4]) || !is_float(argv[5])) {
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+        }
+
+        float sigma_s = atof(argv[4]);
+        float sigma_r = atof(argv[5]);
+
+        switch (bilateral(old_img, fp2, sigma_s, sigma_r)) {
+
+        case -1:
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+
+        case 0:
+            fprintf(stderr, "Could not write\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_WRITE_FAILED;
+        }
+    }
+
+
+    // Calls motion-blur
+    else if (strcmp(operation, "motion-blur") == 0) {
+        if (argc != 6) {
+            fprintf(stderr, "Incorrect number of arguments passed\n");
+            print_usage();
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_INVALID_OP_ARGS;
+        }
+
+        if (!is_float(argv[4]) || !is_signed_float(argv[5])) {
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+        }
+
+        float length = atof(argv[4]);
+        float angle = atof(argv[5]);
+
+        switch (motion_blur(old_img, fp2, length, angle)) {
+
+        case -1:
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+
+        case 0:
+            fprintf(stderr, "Could not write\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_WRITE_FAILED;
+        }
+    }
+
+
+    // Calls median
+    else if (strcmp(operation, "median") == 0) {
+        if (argc != 5) {
+            fprintf(stderr, "Incorrect number of arguments passed\n");
+            print_usage();
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_INVALID_OP_ARGS;
+        }
+
+        if (!is_integer(argv[4])) {
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+        }
+
+        switch (median(old_img, fp2, atoi(argv[4]))) {
+
+        case -1:
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+
+        case 0:
+            fprintf(stderr, "Could not write\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_WRITE_FAILED;
+        }
+    }
+
+
+    // Calls rotate, with an optional interpolation (default bilinear)
+    else if (strcmp(operation, "rotate") == 0) {
+        if (argc != 5 && argc != 6) {
+            fprintf(stderr, "Incorrect number of arguments passed\n");
+            print_usage();
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_INVALID_OP_ARGS;
+        }
+
+        Interpolation interp = INTERP_BILINEAR;
+        if (!is_signed_float(argv[4]) ||
+                (argc == 6 && parse_interpolation(argv[5], &interp) != 0)) {
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+        }
+
+        switch (rotate(old_img, fp2, atof(argv[4]), interp)) {
+
+        case -1:
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+
+        case 0:
+            fprintf(stderr, "Could not write\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_WRITE_FAILED;
+        }
+    }
+
+
+    // Calls affine, with an optional interpolation (default bilinear)
+    else if (strcmp(operation, "affine") == 0) {
+        if (argc != 10 && argc != 11) {
+            fprintf(stderr, "Incorrect number of arguments passed\n");
+            print_usage();
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_INVALID_OP_ARGS;
+        }
+
+        double m[6];
+        int valid = 1;
+        for (int k = 0; k < 6; k++) {
+            valid = valid && is_signed_float(argv[4 + k]);
+            m[k] = atof(argv[4 + k]);
+        }
+
+        Interpolation interp = INTERP_BILINEAR;
+        if (!valid ||
+                (argc == 11 && parse_interpolation(argv[10], &interp) != 0)) {
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+        }
+
+        switch (affine(old_img, fp2, m, interp)) {
+
+        case -1:
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+
+        case 0:
+            fprintf(stderr, "Could not write\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_WRITE_FAILED;
+        }
+    }
+
+
+    // Calls convolve, with an optional border mode (default clamp)
+    else if (strcmp(operation, "convolve") == 0) {
+        if (argc != 5 && argc != 6) {
+            fprintf(stderr, "Incorrect number of arguments passed\n");
+            print_usage();
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_INVALID_OP_ARGS;
+        }
+
+        BorderMode border = BORDER_CLAMP;
+        if (argc == 6 && parse_border(argv[5], &border) != 0) {
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+        }
+
+        FILE * kernel_file = fopen(argv[4], "r");
+        if (!kernel_file) {
+            fprintf(stderr, "Unable to read kernel\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OPEN_FAILED;
+        }
+        ConvKernel * kernel = read_conv_kernel(kernel_file);
+        fclose(kernel_file);
+
+        if (!kernel) {
+            fprintf(stderr, "Invalid argument for operation\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+        }
+
+        int convolve_output = convolve(old_img, fp2, kernel, border);
+        free_conv_kernel(&kernel);
+
+        if (convolve_output == 0) {
+            fprintf(stderr, "Could not write\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_WRITE_FAILED;
+        }
+    }
+
+
+    // Calls stats/histogram, which write JSON to the output file
+    else if (strcmp(operation, "stats") == 0 ||
+             strcmp(operation, "histogram") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Incorrect number of arguments passed\n");
+            print_usage();
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_INVALID_OP_ARGS;
+        }
+
+        int with_histograms = strcmp(operation, "histogram") == 0;
+        if (stats(old_img, fp2, with_histograms) == 0) {
+            fprintf(stderr, "Could not write\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_WRITE_FAILED;
+        }
+    }
+
+
+    // Calls equalize
+    else if (strcmp(operation, "equalize") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Incorrect number of arguments passed\n");
+            print_usage();
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_INVALID_OP_ARGS;
+        }
+
+        if (equalize(old_img, fp2) == 0) {
+            fprintf(stderr, "Could not write\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_WRITE_FAILED;
+        }
+    }
+
+
+    // Calls compare, which reads a second image to compare against
+    else if (strcmp(operation, "compare") == 0) {
+        if (argc != 5) {
+            fprintf(stderr, "Incorrect number of arguments passed\n");
+            print_usage();
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_INVALID_OP_ARGS;
+        }
+
+        FILE * fp3 = fopen(argv[4], "rb");
+        if (!fp3) {
+            fprintf(stderr, "Unable to read\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OPEN_FAILED;
+        }
+        Image * other_img = read_ppm(fp3);
+        fclose(fp3);
+
+        if (other_img == NULL) {
+            fprintf(stderr, "Input file cannot be read as a ppm\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_INVALID_PPM;
+        }
+
+        int compare_output = compare(old_img, fp2, other_img);
+        free_image(&other_img);
+
+        switch (compare_output) {
+
+        case -2:
+            fprintf(stderr, "Out of memory\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_UNSPECIFIED_ERR;
+
+        case -1:
+            fprintf(stderr, "Images are different sizes\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_OP_ARGS_RANGE_ERR;
+
+        case 0:
+            fprintf(stderr, "Could not write\n");
+            free_files(fp1, fp2);
+            free_image(&old_img);
+            return RC_WRITE_FAILED;
+        }
+    }
+
+
     // Returns error if operation keyword is invalid
     else {
         fprintf(stderr, "Operation not recognized\n");
@@ -282,12 +767,26 @@ int main (int argc, char* argv[]) {
 void print_usage() {
     printf("USAGE: ./project <input-image> <output-image> <command-name> <command-args>\n");
     printf("SUPPORTED COMMANDS:\n");
-    printf("   binarize <treshhold>\n");
+    printf("   binarize <treshhold>|auto [p4|p5|p6]\n");
     printf("   crop <top-lt-col> <top-lt-row> <bot-rt-col> <bot-rt-row>\n");
-    printf("   zoom_in\n");
+    printf("   zoom_in [<factor>]\n");
     printf("   rotate-left\n");
+    printf("   rotate <degrees> [nearest|bilinear]\n");
+    printf("      (keeps the image size, cropping the corners; 90 and 270 swap it)\n");
+    printf("   affine <a> <b> <c> <d> <e> <f> [nearest|bilinear]\n");
     printf("   pointillism\n");
     printf("   blur <sigma>\n");
+    printf("   sobel\n");
+    printf("   sharpen\n");
+    printf("   unsharp <sigma> <amount>\n");
+    printf("   bilateral <sigma_s> <sigma_r>\n");
+    printf("   motion-blur <length> <angle>\n");
+    printf("   median <radius>\n");
+    printf("   convolve <kernel-file> [clamp|mirror|zero|renormalize]\n");
+    printf("   stats\n");
+    printf("   histogram\n");
+    printf("   equalize\n");
+    printf("   compare <other-image>\n");
 }
 
 
@@ -326,9 +825,68 @@ int is_float(char * str) {
 }
 
 
+
+// is_float, also allowing a leading minus sign
+int is_signed_float(char * str) {
+    return is_float(str + (str[0] == '-'));
+}
+
+
 // Frees the two inputted FILE objects
 void free_files(FILE * file1, FILE * file2) {
     fclose(file1);
     fclose(file2);
 }
 
+
+
+
+// Parses a border mode name; returns 0 on success, -1 if not recognized
+int parse_border(const char * str, BorderMode * border) {
+    if (strcmp(str, "clamp") == 0) {
+        *border = BORDER_CLAMP;
+    } else if (strcmp(str, "mirror") == 0) {
+        *border = BORDER_MIRROR;
+    } else if (strcmp(str, "zero") == 0) {
+        *border = BORDER_ZERO;
+    } else if (strcmp(str, "renormalize") == 0) {
+        *border = BORDER_RENORMALIZE;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+
+/* Returns 1 and sets format for the packed binarize outputs (p4, p5),
+ * 0 for a regular PPM (p6), or -1 if str isn't a format */
+int parse_binary_format(const char * str, BinaryFormat * format) {
+    if (strcmp(str, "p4") == 0) {
+        *format = BINARY_PBM;
+    } else if (strcmp(str, "p5") == 0) {
+        *format = BINARY_PGM;
+    } else if (strcmp(str, "p6") == 0) {
+        return 0;
+    } else {
+        return -1;
+    }
+
+    return 1;
+}
+
+
+
+/* Sets interp from its name; returns -1 if str isn't one */
+int parse_interpolation(const char * str, Interpolation * interp) {
+    if (strcmp(str, "nearest") == 0) {
+        *interp = INTERP_NEAREST;
+    } else if (strcmp(str, "bilinear") == 0) {
+        *interp = INTERP_BILINEAR;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
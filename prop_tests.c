@@ -0,0 +1,449 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include "ppm_io.h"
+#include "image_manip.h"
+
+
+/* Property tests for the image operations: round trips that must give
+ * back the input exactly, run on images of awkward sizes, in both the
+ * copying and in-place modes and with the specialized kernels on and off.
+ * Also has regression tests for bugs in read_ppm, checks the images
+ * ./checkerboard generates have the patterns they should, and checks
+ * diff_images and the perceptual hash on known differences.
+ * USAGE: ./prop_tests (from the source directory, after make checkerboard)
+ * Prints each failure and exits nonzero if there were any.
+ */
+
+
+// Image sizes to try: single pixels, lines, odd and tile-straddling sizes
+static const int sizes[][2] = {
+    { 1, 1 }, { 1, 9 }, { 7, 1 }, { 5, 7 }, { 16, 16 }, { 33, 70 }, { 65, 3 }
+};
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static int failures = 0;
+
+
+// Records a failed check
+static void check(int ok, const char *what, const Image *img, int mode) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s on %dx%d (in place %d, specialized %d)\n",
+                what, img->cols, img->rows, mode & 1, !(mode & 2));
+        failures++;
+    }
+}
+
+
+// Makes a rows x cols image of random pixels
+static Image * random_image(int rows, int cols) {
+    Image *img = make_image(rows, cols);
+    if (img) {
+        unsigned char *bytes = (unsigned char *) img->data;
+        for (size_t i = 0; i < image_bytes(rows, cols); i++) {
+            bytes[i] = rand() & 0xff;
+        }
+    }
+    return img;
+}
+
+
+/* Runs an operation writing to a temporary file, and reads the result
+ * back; returns NULL if the operation or the read failed. The image
+ * passed in is a copy, since in-place mode overwrites it.
+ */
+#define RUN_OP(result, img, call) do {                  \
+        Image *in_ = make_copy((Image *) (img));        \
+        FILE *tmp_ = tmpfile();                         \
+        (result) = NULL;                                \
+        if (in_ && tmp_) {                              \
+            Image *img1 = in_;                          \
+            FILE *new_image = tmp_;                     \
+            if ((call) > 0) {                           \
+                rewind(tmp_);                           \
+                (result) = read_ppm(tmp_);              \
+            }                                           \
+        }                                               \
+        free_image(&in_);                               \
+        if (tmp_) fclose(tmp_);                         \
+    } while (0)
+
+
+// Applies rotate_left, or rotate by degrees, times times over
+static Image * rotate_times(const Image *img, int times, float degrees) {
+    Image *cur = make_copy((Image *) img);
+    for (int i = 0; i < times && cur; i++) {
+        Image *next;
+        if (degrees == 0) {
+            RUN_OP(next, cur, rotate_left(img1, new_image));
+        } else {
+            RUN_OP(next, cur, rotate(img1, new_image, degrees, INTERP_NEAREST));
+        }
+        free_image(&cur);
+        cur = next;
+    }
+    return cur;
+}
+
+
+// Returns 1 if each factor x factor block of big averages to the pixel of
+// small it came from
+static int block_average_equal(const Image *small, const Image *big, int factor) {
+    if (!big || big->rows != small->rows * factor ||
+            big->cols != small->cols * factor) {
+        return 0;
+    }
+    for (int r = 0; r < small->rows; r++) {
+        for (int c = 0; c < small->cols; c++) {
+            int sum[3] = { 0, 0, 0 };
+            for (int i = 0; i < factor; i++) {
+                for (int j = 0; j < factor; j++) {
+                    const Pixel *p = &big->data[(size_t) (r * factor + i) * big->cols +
+                                                c * factor + j];
+                    sum[0] += p->r;
+                    sum[1] += p->g;
+                    sum[2] += p->b;
+                }
+            }
+            const Pixel *q = &small->data[(size_t) r * small->cols + c];
+            int n = factor * factor;
+            if ((sum[0] + n / 2) / n != q->r || (sum[1] + n / 2) / n != q->g ||
+                    (sum[2] + n / 2) / n != q->b) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+static void test_identities(const Image *img, int mode) {
+    Image *out;
+
+    // Four quarter turns, either way, and two half turns
+    out = rotate_times(img, 4, 0);
+    check(out && images_equal(out, img), "rotate_left x4", img, mode);
+    free_image(&out);
+    out = rotate_times(img, 4, 90);
+    check(out && images_equal(out, img), "rotate 90 x4", img, mode);
+    free_image(&out);
+    out = rotate_times(img, 4, -90);
+    check(out && images_equal(out, img), "rotate -90 x4", img, mode);
+    free_image(&out);
+    out = rotate_times(img, 2, 180);
+    check(out && images_equal(out, img), "rotate 180 x2", img, mode);
+    free_image(&out);
+    out = rotate_times(img, 1, 360);
+    check(out && images_equal(out, img), "rotate 360", img, mode);
+    free_image(&out);
+
+    // Rotating a quarter turn left is the same however it is asked for
+    Image *left = rotate_times(img, 1, 0);
+    out = rotate_times(img, 1, 90);
+    check(left && out && images_equal(out, left), "rotate 90 = rotate_left", img, mode);
+    free_image(&out);
+    out = rotate_times(img, 3, -90);
+    check(left && out && images_equal(out, left), "rotate -90 x3 = rotate_left", img, mode);
+    free_image(&out);
+    free_image(&left);
+
+    // Cropping to the full bounds
+    RUN_OP(out, img, crop(img1, new_image, 0, 0, img1->cols, img1->rows));
+    check(out && images_equal(out, img), "full crop", img, mode);
+    free_image(&out);
+
+    // Zooming, then averaging each block back down
+    RUN_OP(out, img, zoom_in(img1, new_image));
+    check(block_average_equal(img, out, 2), "zoom_in, 2x2 average", img, mode);
+    free_image(&out);
+    for (int factor = 1; factor <= 5; factor++) {
+        RUN_OP(out, img, zoom(img1, new_image, factor));
+        check(block_average_equal(img, out, factor), "zoom, block average", img, mode);
+        free_image(&out);
+    }
+
+    // Filters that leave the image as it is
+    RUN_OP(out, img, median(img1, new_image, 0));
+    check(out && images_equal(out, img), "median 0", img, mode);
+    free_image(&out);
+    const double identity[6] = { 1, 0, 0, 0, 1, 0 };
+    RUN_OP(out, img, affine(img1, new_image, identity, INTERP_NEAREST));
+    check(out && images_equal(out, img), "affine identity (nearest)", img, mode);
+    free_image(&out);
+    RUN_OP(out, img, affine(img1, new_image, identity, INTERP_BILINEAR));
+    check(out && images_equal(out, img), "affine identity (bilinear)", img, mode);
+    free_image(&out);
+
+    // Flipping twice
+    const double flip[6] = { -1, 0, img->cols - 1, 0, 1, 0 };
+    Image *once;
+    RUN_OP(once, img, affine(img1, new_image, flip, INTERP_NEAREST));
+    out = NULL;
+    if (once) {
+        RUN_OP(out, once, affine(img1, new_image, flip, INTERP_NEAREST));
+    }
+    check(out && images_equal(out, img), "affine flip x2", img, mode);
+    free_image(&out);
+    free_image(&once);
+
+    // Invalid crops fail without touching the image
+    Image *copy = make_copy((Image *) img);
+    FILE *tmp = tmpfile();
+    if (copy && tmp) {
+        check(crop(copy, tmp, 0, 0, copy->cols + 1, copy->rows) == -1 &&
+              crop(copy, tmp, 1, 1, 1, 1) == -1 && images_equal(copy, img),
+              "invalid crop", img, mode);
+    }
+    free_image(&copy);
+    if (tmp) fclose(tmp);
+}
+
+
+// Reads a PPM file held in memory
+static Image * read_bytes(const char *bytes, size_t size) {
+    FILE *fp = fmemopen((void *) bytes, size, "rb");
+    if (!fp) {
+        return NULL;
+    }
+    Image *img = read_ppm(fp);
+    fclose(fp);
+    return img;
+}
+
+
+static void test_read_ppm(void) {
+    Image dummy = { NULL, 0, 0 };
+
+    // Pixels starting with whitespace-valued bytes are pixels, not header
+    const char spaces[] = "P6\n2 1\n255\n \n\t\r\v\f";
+    Image *img = read_bytes(spaces, sizeof(spaces) - 1);
+    check(img && img->rows == 1 && img->cols == 2 &&
+          memcmp(img->data, " \n\t\r\v\f", 6) == 0,
+          "read_ppm whitespace pixels", &dummy, 0);
+    free_image(&img);
+
+    // Comments between header fields
+    const char comments[] = "P6 # tag\n# size\n1 # cols\n1\n255\n\x01\x02\x03";
+    img = read_bytes(comments, sizeof(comments) - 1);
+    check(img && img->data[0].r == 1 && img->data[0].b == 3,
+          "read_ppm comments", &dummy, 0);
+    free_image(&img);
+
+    // Truncated pixels, headers, numbers too big for an int
+    const char *bad[] = {
+        "P6\n2 2\n255\n\x01\x02\x03", "P6\n2 2\n", "P6\n2", "P6", "",
+        "P5\n1 1\n255\n\x01\x02\x03", "P6\n1 1\n65535\n\x01\x02\x03",
+        "P6\n99999999999999999999 99999999999999999999\n255\n\x01",
+        "P6\n1 1\n255\x01\x02\x03"
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        img = read_bytes(bad[i], strlen(bad[i]));
+        check(img == NULL, "read_ppm rejects bad file", &dummy, 0);
+        free_image(&img);
+    }
+
+    // Freeing a freed image is harmless
+    img = make_image(1, 1);
+    free_image(&img);
+    free_image(&img);
+    check(img == NULL, "free_image sets NULL", &dummy, 0);
+}
+
+
+/* Runs ./checkerboard with the given arguments and reads back the image
+ * it writes; NULL if it fails. The generator has to have been built, and
+ * the tests run from the source directory (as "make check" does).
+ */
+static Image * generate(int cols, int rows, const char *pattern,
+                        const char *param) {
+    char path[] = "/tmp/prop_tests_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return NULL;
+    }
+    close(fd);
+
+    char command[256];
+    snprintf(command, sizeof(command), "./checkerboard %s %d %d %s %s",
+             path, cols, rows, pattern, param ? param : "");
+    Image *img = NULL;
+    if (system(command) == 0) {
+        FILE *fp = fopen(path, "rb");
+        if (fp) {
+            img = read_ppm(fp);
+            fclose(fp);
+        }
+    }
+    remove(path);
+    return img;
+}
+
+
+// Returns 1 if img is a square x square checkerboard, black at top-left
+static int is_checkerboard(const Image *img, int square) {
+    for (int i = 0; i < img->rows; i++) {
+        for (int j = 0; j < img->cols; j++) {
+            const Pixel *p = &img->data[(size_t) i * img->cols + j];
+            const Pixel *first = &img->data[(size_t) (i - i % square) *
+                                            img->cols + (j - j % square)];
+
+            // Gray, the same as the top-left pixel of its cell (so each
+            // cell is uniform), and black or white as the cells alternate
+            if (p->r != p->g || p->g != p->b || p->r != first->r ||
+                    p->r != ((i / square + j / square) % 2 ? 255 : 0)) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+static void test_checkerboard(void) {
+    Image dummy = { NULL, 0, 0 };
+
+    // Sizes that cut cells off at the right and bottom edges, and cells
+    // bigger than the image
+    static const int boards[][3] = {
+        { 1, 1, 8 }, { 37, 21, 8 }, { 64, 64, 1 }, { 10, 33, 3 }, { 5, 7, 50 }
+    };
+    for (size_t b = 0; b < sizeof(boards) / sizeof(boards[0]); b++) {
+        char param[16];
+        snprintf(param, sizeof(param), "%d", boards[b][2]);
+        Image *img = generate(boards[b][0], boards[b][1], "checkerboard", param);
+        check(img && img->cols == boards[b][0] && img->rows == boards[b][1] &&
+              is_checkerboard(img, boards[b][2]), "checkerboard cells",
+              img ? img : &dummy, 0);
+        free_image(&img);
+    }
+    Image *img = generate(20, 12, "checkerboard", NULL);
+    check(img && is_checkerboard(img, 8), "checkerboard default square",
+          img ? img : &dummy, 0);
+    free_image(&img);
+
+    // Stripes are a checkerboard with one row of cells
+    img = generate(30, 1, "stripes", "4");
+    check(img && is_checkerboard(img, 4), "stripes", img ? img : &dummy, 0);
+    free_image(&img);
+
+    // Gradient ramps end to end, noise is reproducible from its seed
+    img = generate(9, 5, "gradient", NULL);
+    check(img && img->data[0].r == 0 && img->data[0].g == 0 &&
+          img->data[8].r == 255 && img->data[4 * 9].g == 255,
+          "gradient corners", img ? img : &dummy, 0);
+    free_image(&img);
+    Image *a = generate(17, 9, "noise", "7");
+    Image *b = generate(17, 9, "noise", "7");
+    Image *c = generate(17, 9, "noise", "8");
+    check(a && b && c && images_equal(a, b) && !images_equal(a, c),
+          "noise seeds", a ? a : &dummy, 0);
+    free_image(&a);
+    free_image(&b);
+    free_image(&c);
+
+    // Invalid arguments write nothing
+    static const char *invalid[][2] = {
+        { "checkerboard", "0" }, { "checkerboard", "2.5" },
+        { "checkerboard", "99999999999" }, { "stripes", "-3" },
+        { "noise", "-1" }, { "noise", "seed" }, { "solid", "300" },
+        { "solid", "-1" }, { "zoneplate", "nan" }
+    };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        img = generate(8, 8, invalid[i][0], invalid[i][1]);
+        check(img == NULL, "checkerboard rejects bad parameter", &dummy, 0);
+        free_image(&img);
+    }
+    img = generate(3, 2, "solid", "255");
+    check(img && img->data[5].r == 255 && img->data[5].b == 255,
+          "solid 255", img ? img : &dummy, 0);
+    free_image(&img);
+}
+
+
+static void test_diff(void) {
+    Image *a = random_image(33, 70);
+    Image *b = make_copy(a);
+    Image *mask = make_image(33, 70);
+    Image *small = make_image(32, 70);
+    if (!a || !b || !mask || !small) {
+        check(0, "diff_images test images", a ? a : mask, 0);
+        free_image(&a);
+        free_image(&b);
+        free_image(&mask);
+        free_image(&small);
+        return;
+    }
+
+    // Equal images: no differences, infinite PSNR, the same hash
+    ImageDiff diff;
+    check(diff_images(a, b, &diff, mask) == 0 && diff.psnr == INFINITY &&
+          diff.mse == 0 && diff.max_diff == 0 && diff.differing == 0,
+          "diff_images of equal images", a, 0);
+    check(hash_distance(image_dhash(a), image_dhash(b)) == 0,
+          "hash distance of equal images", a, 0);
+
+    // One pixel changed in one channel
+    Pixel *p = &b->data[(size_t) 20 * b->cols + 45];
+    int delta = p->g < 128 ? 100 : -100;
+    p->g += delta;
+    check(diff_images(a, b, &diff, mask) == 0 && diff.max_diff == 100 &&
+          diff.differing == 1 && diff.psnr > 0 && diff.psnr != INFINITY &&
+          diff.mse == 100.0 * 100.0 / (3.0 * 33 * 70),
+          "diff_images of a one-pixel change", a, 0);
+
+    // The mask is white at that pixel and black everywhere else
+    int mask_ok = 1;
+    for (size_t x = 0; x < (size_t) mask->rows * mask->cols; x++) {
+        int v = x == (size_t) 20 * mask->cols + 45 ? 255 : 0;
+        const Pixel *m = &mask->data[x];
+        mask_ok &= m->r == v && m->g == v && m->b == v;
+    }
+    check(mask_ok, "diff_images mask", a, 0);
+
+    check(diff_images(a, small, &diff, NULL) == -1,
+          "diff_images rejects different sizes", a, 0);
+    check(diff_images(a, b, &diff, small) == -1,
+          "diff_images rejects a different-sized mask", a, 0);
+
+    free_image(&a);
+    free_image(&b);
+    free_image(&mask);
+    free_image(&small);
+}
+
+
+int main(void) {
+    srand(1);
+
+    // Errors from the deliberately bad files are expected
+    fprintf(stderr, "(read errors below are expected)\n");
+    test_read_ppm();
+    test_checkerboard();
+    fprintf(stderr, "(end of expected errors)\n");
+    test_diff();
+
+    for (int mode = 0; mode < 4; mode++) {
+        use_in_place(mode & 1);
+        use_specialized_kernels(!(mode & 2));
+        for (size_t i = 0; i < NUM_SIZES; i++) {
+            Image *img = random_image(sizes[i][0], sizes[i][1]);
+            if (!img) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+            test_identities(img, mode);
+            free_image(&img);
+        }
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all property tests passed\n");
+    return 0;
+}